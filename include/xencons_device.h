@@ -32,8 +32,252 @@
 #ifndef _XENCONS_DEVICE_H
 #define _XENCONS_DEVICE_H
 
+// There is an instance of this interface for each console. The primary
+// console's instance has no reference string. Each secondary console
+// (device/console/N in xenstore) has its own instance, with N as the
+// reference string, so its device path ends in "\N".
 // {0D3EDD21-8EF9-4DFF-856C-8C68BF4FDCA3}
 DEFINE_GUID(GUID_XENCONS_DEVICE,
             0xd3edd21, 0x8ef9, 0x4dff, 0x85, 0x6c, 0x8c, 0x68, 0xbf, 0x4f, 0xdc, 0xa3);
 
+#define XENCONS_IOCTL(_Function, _Access) \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800 + (_Function), METHOD_BUFFERED, (_Access))
+
+// Completes once all data written on the handle before the request has
+// been copied into the console ring. Later writes on the handle are held
+// until it completes. IRP_MJ_FLUSH_BUFFERS (FlushFileBuffers) has the
+// same effect.
+#define IOCTL_XENCONS_FLUSH XENCONS_IOCTL(0x00, FILE_WRITE_ACCESS)
+
+// Input: ULONG. If non-zero, writes on the handle do not complete until
+// the whole buffer has been accepted, so the caller never sees a short
+// write. A handle opened with FILE_FLAG_WRITE_THROUGH starts in this
+// mode.
+#define IOCTL_XENCONS_SET_WRITE_WHOLE XENCONS_IOCTL(0x01, FILE_WRITE_ACCESS)
+
+// Layout of the start of a mapping returned by IOCTL_XENCONS_MAP_RINGS.
+// Offsets are from the start of the mapping and sizes are powers of two.
+// Indices are free-running; the position in a ring is the index modulo
+// its size. The driver writes ReceiveProducer and TransmitConsumer and
+// the caller writes ReceiveConsumer and TransmitProducer.
+typedef struct _XENCONS_RING_HEADER {
+    volatile ULONG  ReceiveProducer;
+    volatile ULONG  ReceiveConsumer;
+    volatile ULONG  TransmitProducer;
+    volatile ULONG  TransmitConsumer;
+    ULONG           ReceiveOffset;
+    ULONG           ReceiveSize;
+    ULONG           TransmitOffset;
+    ULONG           TransmitSize;
+} XENCONS_RING_HEADER, *PXENCONS_RING_HEADER;
+
+typedef struct _XENCONS_MAP_RINGS_IN {
+    ULONG64 Event;      // Event handle signalled when either index moves
+} XENCONS_MAP_RINGS_IN, *PXENCONS_MAP_RINGS_IN;
+
+typedef struct _XENCONS_MAP_RINGS_OUT {
+    ULONG64 Address;    // Start of the mapping (an XENCONS_RING_HEADER)
+    ULONG   Length;
+} XENCONS_MAP_RINGS_OUT, *PXENCONS_MAP_RINGS_OUT;
+
+// Input: XENCONS_MAP_RINGS_IN. Output: XENCONS_MAP_RINGS_OUT.
+// Maps a receive and transmit ring pair into the caller's address space.
+// Once mapped, console data for the handle moves only through the rings
+// and read and write requests on the handle fail. The mapping lasts
+// until the handle is closed.
+#define IOCTL_XENCONS_MAP_RINGS XENCONS_IOCTL(0x02, FILE_ANY_ACCESS)
+
+// Prompts the driver to look at the mapped rings. This is needed after
+// producing transmit data, and after consuming receive data from a full
+// receive ring; at any other time the driver picks up index changes by
+// itself.
+#define IOCTL_XENCONS_KICK XENCONS_IOCTL(0x03, FILE_ANY_ACCESS)
+
+// Times are in milliseconds and a value of zero disables that control.
+// A read completes as soon as MinimumLength bytes, or the length of the
+// read if less, are available; or once some data is available and none
+// has arrived for IntervalTimeout; or once the read has been pending for
+// TotalTimeout, with whatever is available (possibly nothing). The
+// default, all zero, completes a read as soon as any data is available.
+typedef struct _XENCONS_READ_TIMEOUTS {
+    ULONG   MinimumLength;
+    ULONG   IntervalTimeout;
+    ULONG   TotalTimeout;
+} XENCONS_READ_TIMEOUTS, *PXENCONS_READ_TIMEOUTS;
+
+// Input: XENCONS_READ_TIMEOUTS. Sets the read timeouts for the handle.
+#define IOCTL_XENCONS_SET_READ_TIMEOUTS XENCONS_IOCTL(0x04, FILE_READ_ACCESS)
+
+// Counters are kept both for each handle and for the device as a whole.
+// Fields that only make sense for the device are zero for a handle.
+typedef struct _XENCONS_STATISTICS {
+    ULONG64 BytesRead;
+    ULONG64 BytesWritten;
+    ULONG64 ReadsCompleted;
+    ULONG64 WritesCompleted;
+    ULONG64 RequestsCancelled;
+    ULONG64 RequestsBlocked;        // Put back on a queue to wait
+    ULONG64 EmptyWakeups;           // Device: worker found nothing to do
+    ULONG64 PollWakeups;            // Device: worker found work by polling
+    ULONG64 ReceiveDropped;         // Bytes lost to a full FIFO (device)
+                                    // or read buffer (handle)
+    ULONG   ReceiveOverflows;       // Episodes of the above
+    ULONG   ReadQueueHighWater;
+    ULONG   WriteQueueHighWater;
+} XENCONS_STATISTICS, *PXENCONS_STATISTICS;
+
+typedef struct _XENCONS_QUERY_STATISTICS_OUT {
+    XENCONS_STATISTICS  Handle;
+    XENCONS_STATISTICS  Device;
+} XENCONS_QUERY_STATISTICS_OUT, *PXENCONS_QUERY_STATISTICS_OUT;
+
+// Output: XENCONS_QUERY_STATISTICS_OUT.
+#define IOCTL_XENCONS_QUERY_STATISTICS XENCONS_IOCTL(0x05, FILE_ANY_ACCESS)
+
+#define XENCONS_LATENCY_BUCKETS 32
+
+// Bucket N counts requests for which the phase took from 2^N to
+// 2^(N+1)-1 microseconds; bucket 0 also counts those that took none.
+typedef struct _XENCONS_LATENCY_HISTOGRAM {
+    ULONG64 Queued[XENCONS_LATENCY_BUCKETS];    // Arrival to first attempt
+    ULONG64 Blocked[XENCONS_LATENCY_BUCKETS];   // First to final attempt
+    ULONG64 Copy[XENCONS_LATENCY_BUCKETS];      // Final attempt
+} XENCONS_LATENCY_HISTOGRAM, *PXENCONS_LATENCY_HISTOGRAM;
+
+typedef struct _XENCONS_LATENCY {
+    XENCONS_LATENCY_HISTOGRAM   Read;
+    XENCONS_LATENCY_HISTOGRAM   Write;
+} XENCONS_LATENCY, *PXENCONS_LATENCY;
+
+// Output: XENCONS_LATENCY. Latency histograms for the whole device.
+#define IOCTL_XENCONS_QUERY_LATENCY XENCONS_IOCTL(0x06, FILE_ANY_ACCESS)
+
+// Clears the latency histograms. As this affects every handle, the
+// handle must be open for reading.
+#define IOCTL_XENCONS_RESET_LATENCY XENCONS_IOCTL(0x07, FILE_READ_ACCESS)
+
+// Events recorded in the binary trace. Arguments are listed for each.
+#define XENCONS_TRACE_DISPATCH  0x0001  // Major, Minor, Status
+#define XENCONS_TRACE_SUBMIT    0x0002  // Major, Length
+#define XENCONS_TRACE_BLOCKED   0x0003  // Major
+#define XENCONS_TRACE_COMPLETE  0x0004  // Major, Status, Information
+#define XENCONS_TRACE_CANCEL    0x0005  // Major, Information
+#define XENCONS_TRACE_WAKEUP    0x0006  // Transmitted, Filled, Received
+
+// Records are written into a ring for each processor and so are only
+// ordered by Sequence within one processor; merge by Timestamp, which
+// is in units of XENCONS_TRACE_HEADER.Frequency.
+typedef struct _XENCONS_TRACE_RECORD {
+    ULONG   Sequence;
+    USHORT  Event;
+    USHORT  Cpu;
+    ULONG64 Timestamp;
+    ULONG   Argument[4];
+} XENCONS_TRACE_RECORD, *PXENCONS_TRACE_RECORD;
+
+typedef struct _XENCONS_TRACE_HEADER {
+    ULONG64 Frequency;
+    ULONG   Count;          // Records following the header
+    ULONG   Lost;           // Records overwritten before they were read
+} XENCONS_TRACE_HEADER, *PXENCONS_TRACE_HEADER;
+
+// Output: XENCONS_TRACE_HEADER followed by as many records as fit.
+// Records are removed from the trace as they are returned, so the
+// handle must be open for reading.
+#define IOCTL_XENCONS_READ_TRACE XENCONS_IOCTL(0x08, FILE_READ_ACCESS)
+
+#define XENCONS_LINE_DELIMITERS 8
+
+// In line mode a read completes once a delimiter has been received,
+// returning the data up to and including it (or as much of it as fits),
+// or once the read can be filled. If Count is zero the delimiters are
+// CR, LF and ^C. Read timeouts other than TotalTimeout are ignored.
+typedef struct _XENCONS_LINE_MODE {
+    ULONG   Enabled;
+    ULONG   Count;
+    UCHAR   Delimiter[XENCONS_LINE_DELIMITERS];
+} XENCONS_LINE_MODE, *PXENCONS_LINE_MODE;
+
+// Input: XENCONS_LINE_MODE. Sets line mode for reads on the handle.
+#define IOCTL_XENCONS_SET_LINE_MODE XENCONS_IOCTL(0x09, FILE_READ_ACCESS)
+
+#define XENCONS_WRITE_SEGMENTS_MAXIMUM  64
+#define XENCONS_WRITE_VECTOR_MAXIMUM    (64 * 1024)
+
+typedef struct _XENCONS_WRITE_SEGMENT {
+    ULONG64 Buffer;         // Address in the caller's process
+    ULONG   Length;
+    ULONG   Reserved;
+} XENCONS_WRITE_SEGMENT, *PXENCONS_WRITE_SEGMENT;
+
+// Input: an array of up to XENCONS_WRITE_SEGMENTS_MAXIMUM segments,
+// totalling no more than XENCONS_WRITE_VECTOR_MAXIMUM bytes. The
+// segments are written in order, after any writes ahead of them on the
+// handle, and complete only once they have all been buffered. Output
+// from other writers is not interleaved with them provided that they
+// fit in the transmit buffer.
+#define IOCTL_XENCONS_WRITE_VECTOR XENCONS_IOCTL(0x0A, FILE_WRITE_ACCESS)
+
+#define XENCONS_WRITE_PRIORITY_MAXIMUM  64
+
+// Input: up to XENCONS_WRITE_PRIORITY_MAXIMUM bytes. Intended for short
+// control sequences, which are sent ahead of any output already
+// buffered by the device (from this or any other handle). Completes once
+// all the bytes have been buffered.
+#define IOCTL_XENCONS_WRITE_PRIORITY XENCONS_IOCTL(0x0B, FILE_WRITE_ACCESS)
+
+// Byte counts are a snapshot and may be out of date by the time they
+// are returned. The backend's rings do not report their occupancy, only
+// whether they can currently be read or written.
+typedef struct _XENCONS_OCCUPANCY {
+    ULONG   ReadAvailable;      // Handle: input buffered for the handle
+    ULONG   ReadSize;
+    ULONG   ReceivePending;     // Device: input not yet given to every handle
+    ULONG   ReceiveSize;
+    ULONG   WriteSpace;         // Device: free space for buffered output
+    ULONG   WriteSize;
+    ULONG   RingReadable;       // Input ring holds data
+    ULONG   RingWritable;       // Output ring has space
+} XENCONS_OCCUPANCY, *PXENCONS_OCCUPANCY;
+
+// Output: XENCONS_OCCUPANCY.
+#define IOCTL_XENCONS_QUERY_OCCUPANCY XENCONS_IOCTL(0x0C, FILE_ANY_ACCESS)
+
+// Transitions timed in XENCONS_RESUME_SAMPLE.Transition
+#define XENCONS_TRANSITION_D3_TO_D0     1
+#define XENCONS_TRANSITION_D0_TO_D3     2
+#define XENCONS_TRANSITION_RESUME       3   // After migration or S3/S4
+
+// Indices into XENCONS_RESUME_SAMPLE.Phase
+#define XENCONS_PHASE_CONSOLE_ENABLE        0   // Stream restart
+#define XENCONS_PHASE_CONSOLE_DISABLE       1
+#define XENCONS_PHASE_INTERFACE_ACQUIRE     2
+#define XENCONS_PHASE_INTERFACE_RELEASE     3
+#define XENCONS_PHASE_DISTRIBUTION_CLEAR    4
+#define XENCONS_PHASE_DISTRIBUTION_SET      5
+#define XENCONS_PHASE_DISTRIBUTION_COMMIT   6
+#define XENCONS_PHASE_DEFERRAL              7   // Resume to deferred update
+#define XENCONS_PHASES                      8
+
+#define XENCONS_RESUME_SAMPLES  16
+
+// Times are in microseconds. Phases that are not part of a transition
+// are zero.
+typedef struct _XENCONS_RESUME_SAMPLE {
+    ULONG   Sequence;           // Counts transitions since the device started
+    ULONG   Transition;
+    LONG64  SystemTime;         // When the transition started
+    ULONG   Total;
+    ULONG   Phase[XENCONS_PHASES];
+} XENCONS_RESUME_SAMPLE, *PXENCONS_RESUME_SAMPLE;
+
+typedef struct _XENCONS_RESUME_TIMING {
+    ULONG                   Count;      // Valid samples, oldest first
+    ULONG                   Reserved;
+    XENCONS_RESUME_SAMPLE   Sample[XENCONS_RESUME_SAMPLES];
+} XENCONS_RESUME_TIMING, *PXENCONS_RESUME_TIMING;
+
+// Output: XENCONS_RESUME_TIMING. The most recent power transitions.
+#define IOCTL_XENCONS_QUERY_RESUME_TIMING XENCONS_IOCTL(0x0D, FILE_ANY_ACCESS)
+
 #endif  // _XENCONS_DEVICE_H
@@ -87,6 +87,9 @@ MONITOR_CONTEXT MonitorContext;
 
 #define MAXIMUM_BUFFER_SIZE 1024
 
+#define MONITOR_READ_INTERVAL   10  // ms
+#define MONITOR_READS           4
+
 #define SERVICES_KEY "SYSTEM\\CurrentControlSet\\Services"
 
 #define SERVICE_KEY(_Service) \
@@ -265,7 +268,9 @@ MonitorGetPath(
     HDEVINFO                            DeviceInfoSet;
     SP_DEVICE_INTERFACE_DATA            DeviceInterfaceData;
     PSP_DEVICE_INTERFACE_DETAIL_DATA    DeviceInterfaceDetail;
+    DWORD                               Index;
     DWORD                               Size;
+    size_t                              Length;
     HRESULT                             Error;
     BOOL                                Success;
 
@@ -279,40 +284,52 @@ MonitorGetPath(
     if (DeviceInfoSet == INVALID_HANDLE_VALUE)
         goto fail1;
 
-    DeviceInterfaceData.cbSize = sizeof (SP_DEVICE_INTERFACE_DATA);
+    // Secondary consoles have instances of the interface too. The
+    // primary console's is the one without a reference string, so its
+    // path ends with the interface GUID.
+    for (Index = 0; ; Index++) {
+        DeviceInterfaceData.cbSize = sizeof (SP_DEVICE_INTERFACE_DATA);
 
-    Success = SetupDiEnumDeviceInterfaces(DeviceInfoSet,
-                                          NULL,
-                                          Guid,
-                                          0,
-                                          &DeviceInterfaceData);
-    if (!Success)
-        goto fail2;
-
-    Success = SetupDiGetDeviceInterfaceDetail(DeviceInfoSet,
-                                              &DeviceInterfaceData,
+        Success = SetupDiEnumDeviceInterfaces(DeviceInfoSet,
                                               NULL,
-                                              0,
-                                              &Size,
-                                              NULL);
-    if (!Success && GetLastError() != ERROR_INSUFFICIENT_BUFFER)
-        goto fail3;
+                                              Guid,
+                                              Index,
+                                              &DeviceInterfaceData);
+        if (!Success)
+            goto fail2;
 
-    DeviceInterfaceDetail = calloc(1, Size);
-    if (DeviceInterfaceDetail == NULL)
-        goto fail4;
+        Success = SetupDiGetDeviceInterfaceDetail(DeviceInfoSet,
+                                                  &DeviceInterfaceData,
+                                                  NULL,
+                                                  0,
+                                                  &Size,
+                                                  NULL);
+        if (!Success && GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            goto fail3;
 
-    DeviceInterfaceDetail->cbSize =
-        sizeof (SP_DEVICE_INTERFACE_DETAIL_DATA);
+        DeviceInterfaceDetail = calloc(1, Size);
+        if (DeviceInterfaceDetail == NULL)
+            goto fail4;
 
-    Success = SetupDiGetDeviceInterfaceDetail(DeviceInfoSet,
-                                              &DeviceInterfaceData,
-                                              DeviceInterfaceDetail,
-                                              Size,
-                                              NULL,
-                                              NULL);
-    if (!Success)
-        goto fail5;
+        DeviceInterfaceDetail->cbSize =
+            sizeof (SP_DEVICE_INTERFACE_DETAIL_DATA);
+
+        Success = SetupDiGetDeviceInterfaceDetail(DeviceInfoSet,
+                                                  &DeviceInterfaceData,
+                                                  DeviceInterfaceDetail,
+                                                  Size,
+                                                  NULL,
+                                                  NULL);
+        if (!Success)
+            goto fail5;
+
+        Length = _tcslen(DeviceInterfaceDetail->DevicePath);
+        if (Length != 0 &&
+            DeviceInterfaceDetail->DevicePath[Length - 1] == TEXT('}'))
+            break;
+
+        free(DeviceInterfaceDetail);
+    }
 
     *Path = _tcsdup(DeviceInterfaceDetail->DevicePath);
 
@@ -708,34 +725,65 @@ fail1:
     return 1;
 }
 
+// Keep several reads posted so that the driver always has somewhere to
+// put data as soon as it arrives. The driver completes reads on a handle
+// in the order they were issued, so they are reaped in the same order.
+typedef struct _MONITOR_READ {
+    OVERLAPPED  Overlapped;
+    BOOL        Pending;
+    UCHAR       Buffer[MAXIMUM_BUFFER_SIZE];
+} MONITOR_READ, *PMONITOR_READ;
+
+// A read that fails without being queued never signals its event, so
+// it must not be waited for.
+static BOOL
+PostRead(
+    IN  HANDLE          Device,
+    IN  PMONITOR_READ   Read
+    )
+{
+    Read->Pending = ReadFile(Device,
+                             Read->Buffer,
+                             sizeof(Read->Buffer),
+                             NULL,
+                             &Read->Overlapped) ||
+                    GetLastError() == ERROR_IO_PENDING;
+
+    return Read->Pending;
+}
+
 DWORD WINAPI
 DeviceThread(
     IN  LPVOID          Argument
     )
 {
-    PMONITOR_CONTEXT    Context = &MonitorContext;
-    OVERLAPPED          Overlapped;
-    HANDLE              Device;
-    UCHAR               Buffer[MAXIMUM_BUFFER_SIZE];
-    DWORD               Length;
-    DWORD               Wait;
-    HANDLE              Handles[2];
-    DWORD               Error;
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PMONITOR_READ           Read;
+    HANDLE                  Device;
+    DWORD                   Index;
+    DWORD                   Pending;
+    DWORD                   Length;
+    DWORD                   Wait;
+    HANDLE                  Handles[2];
+    XENCONS_READ_TIMEOUTS   Timeouts;
+    DWORD                   Error;
 
     UNREFERENCED_PARAMETER(Argument);
 
     Log("====>");
 
-    ZeroMemory(&Overlapped, sizeof(OVERLAPPED));
-    Overlapped.hEvent = CreateEvent(NULL,
-                                    TRUE,
-                                    FALSE,
-                                    NULL);
-    if (Overlapped.hEvent == NULL)
+    Read = calloc(MONITOR_READS, sizeof(MONITOR_READ));
+    if (Read == NULL)
         goto fail1;
 
-    Handles[0] = Context->DeviceEvent;
-    Handles[1] = Overlapped.hEvent;
+    for (Index = 0; Index < MONITOR_READS; Index++) {
+        Read[Index].Overlapped.hEvent = CreateEvent(NULL,
+                                                    TRUE,
+                                                    FALSE,
+                                                    NULL);
+        if (Read[Index].Overlapped.hEvent == NULL)
+            goto fail2;
+    }
 
     Device = CreateFile(Context->DevicePath,
                         GENERIC_READ,
@@ -745,16 +793,43 @@ DeviceThread(
                         FILE_FLAG_OVERLAPPED,
                         NULL);
     if (Device == INVALID_HANDLE_VALUE)
-        goto fail2;
+        goto fail3;
 
-    for (;;) {
+    // Trade a little latency for fewer, larger reads. Older drivers
+    // do not support this, so failure is not fatal.
+    Timeouts.MinimumLength = MAXIMUM_BUFFER_SIZE;
+    Timeouts.IntervalTimeout = MONITOR_READ_INTERVAL;
+    Timeouts.TotalTimeout = 0;
+
+    if (!DeviceIoControl(Device,
+                         IOCTL_XENCONS_SET_READ_TIMEOUTS,
+                         &Timeouts,
+                         sizeof(Timeouts),
+                         NULL,
+                         0,
+                         NULL,
+                         &Read[0].Overlapped) &&
+        GetLastError() == ERROR_IO_PENDING)
+        (VOID) GetOverlappedResult(Device,
+                                   &Read[0].Overlapped,
+                                   &Length,
+                                   TRUE);
+    ResetEvent(Read[0].Overlapped.hEvent);
+
+    Pending = 0;
+    for (Index = 0; Index < MONITOR_READS; Index++)
+        if (PostRead(Device, &Read[Index]))
+            Pending++;
+
+    Handles[0] = Context->DeviceEvent;
+
+    for (Index = 0; Pending != 0; Index = (Index + 1) % MONITOR_READS) {
         PLIST_ENTRY     ListEntry;
 
-        (VOID) ReadFile(Device,
-                        Buffer,
-                        sizeof(Buffer),
-                        NULL,
-                        &Overlapped);
+        if (!Read[Index].Pending)
+            continue;
+
+        Handles[1] = Read[Index].Overlapped.hEvent;
 
         Wait = WaitForMultipleObjects(ARRAYSIZE(Handles),
                                       Handles,
@@ -763,13 +838,16 @@ DeviceThread(
         if (Wait == WAIT_OBJECT_0)
             break;
 
+        Read[Index].Pending = FALSE;
+        Pending--;
+
         if (!GetOverlappedResult(Device,
-                                 &Overlapped,
+                                 &Read[Index].Overlapped,
                                  &Length,
                                  FALSE))
             break;
 
-        ResetEvent(Overlapped.hEvent);
+        ResetEvent(Read[Index].Overlapped.hEvent);
 
         EnterCriticalSection(&Context->CriticalSection);
 
@@ -781,24 +859,48 @@ DeviceThread(
             Instance = CONTAINING_RECORD(ListEntry, MONITOR_PIPE, ListEntry);
 
             PutString(Instance->Pipe,
-                      Buffer,
+                      Read[Index].Buffer,
                       Length);
         }
         LeaveCriticalSection(&Context->CriticalSection);
+
+        if (PostRead(Device, &Read[Index]))
+            Pending++;
     }
 
+    // The buffers cannot be freed until every read has finished
+    CancelIo(Device);
+
+    for (Index = 0; Index < MONITOR_READS; Index++)
+        if (Read[Index].Pending)
+            (VOID) GetOverlappedResult(Device,
+                                       &Read[Index].Overlapped,
+                                       &Length,
+                                       TRUE);
+
     CloseHandle(Device);
 
-    CloseHandle(Overlapped.hEvent);
+    for (Index = 0; Index < MONITOR_READS; Index++)
+        CloseHandle(Read[Index].Overlapped.hEvent);
+
+    free(Read);
 
     Log("<====");
 
     return 0;
 
+fail3:
+    Log("fail3\n");
+
+    Index = MONITOR_READS;
+
 fail2:
     Log("fail2\n");
 
-    CloseHandle(Overlapped.hEvent);
+    while (Index-- != 0)
+        CloseHandle(Read[Index].Overlapped.hEvent);
+
+    free(Read);
 
 fail1:
     Error = GetLastError();
@@ -842,7 +944,8 @@ MonitorAdd(
                                  FILE_SHARE_READ | FILE_SHARE_WRITE,
                                  NULL,
                                  OPEN_EXISTING,
-                                 FILE_ATTRIBUTE_NORMAL,
+                                 FILE_ATTRIBUTE_NORMAL |
+                                 FILE_FLAG_WRITE_THROUGH,
                                  NULL);
 
     if (Context->Device == INVALID_HANDLE_VALUE)
@@ -0,0 +1,1208 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <stdlib.h>
+#include <xencons_device.h>
+
+#include "fdo.h"
+#include "console.h"
+#include "frontend.h"
+#include "stream.h"
+#include "thread.h"
+#include "registry.h"
+#include "trace.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+#define CONSOLE_POOL 'SNOC'
+
+#define CONSOLE_FIFO_SIZE_DEFAULT   (64 * 1024)
+#define CONSOLE_FIFO_SIZE_MINIMUM   PAGE_SIZE
+#define CONSOLE_FIFO_SIZE_MAXIMUM   (1024 * 1024)
+
+#define CONSOLE_READ_AHEAD_SIZE_DEFAULT (16 * 1024)
+
+#define CONSOLE_PRIORITY_SIZE       256
+
+// Microseconds
+#define CONSOLE_POLL_TIME_DEFAULT   50
+#define CONSOLE_POLL_TIME_MAXIMUM   1000
+
+typedef struct _CONSOLE_STREAM {
+    LIST_ENTRY      ListEntry;
+    PXENCONS_STREAM Stream;
+} CONSOLE_STREAM, *PCONSOLE_STREAM;
+
+struct _XENCONS_CONSOLE {
+    PXENCONS_FDO                Fdo;
+    PXENCONS_THREAD             Thread;
+    FAST_MUTEX                  Mutex;
+    LIST_ENTRY                  List;
+    KSPIN_LOCK                  Lock;
+    BOOLEAN                     Enabled;
+    PXENCONS_FRONTEND           Frontend;
+    XENBUS_CONSOLE_INTERFACE    ConsoleInterface;
+    PXENBUS_CONSOLE_WAKEUP      Wakeup;
+    PCHAR                       Fifo;
+    ULONG                       FifoSize;
+    ULONG                       FifoProducer;
+    ULONG                       FifoConsumer;
+    BOOLEAN                     FifoOverflow;
+    PCHAR                       TransmitBuffer;
+    ULONG                       TransmitSize;
+    ULONG64                     TransmitProducer;
+    ULONG64                     TransmitConsumer;
+    ULONG                       ReadAheadSize;
+    CHAR                        PriorityBuffer[CONSOLE_PRIORITY_SIZE];
+    ULONG                       PriorityProducer;
+    ULONG                       PriorityConsumer;
+    ULONG                       PollTime;
+    ULONG                       PollWindow;
+    LONG64                      IdleTime;
+    LONG64                      Frequency;
+    XENCONS_STATISTICS          Statistics;
+    XENCONS_LATENCY             Latency;
+    XENBUS_DEBUG_INTERFACE      DebugInterface;
+    PXENBUS_DEBUG_CALLBACK      DebugCallback;
+};
+
+static FORCEINLINE PVOID
+__ConsoleAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocatePoolWithTag(NonPagedPool, Length, CONSOLE_POOL);
+}
+
+static FORCEINLINE VOID
+__ConsoleFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, CONSOLE_POOL);
+}
+
+// The primary console is reached through the XENBUS CONSOLE interface.
+// Any other console has a frontend of its own.
+static FORCEINLINE BOOLEAN
+__ConsoleCanRead(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    return (Console->Frontend != NULL) ?
+           FrontendCanRead(Console->Frontend) :
+           XENBUS_CONSOLE(CanRead, &Console->ConsoleInterface);
+}
+
+static FORCEINLINE ULONG
+__ConsoleRead(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PCHAR               Data,
+    IN  ULONG               Length
+    )
+{
+    return (Console->Frontend != NULL) ?
+           FrontendRead(Console->Frontend, Data, Length) :
+           XENBUS_CONSOLE(Read, &Console->ConsoleInterface, Data, Length);
+}
+
+static FORCEINLINE BOOLEAN
+__ConsoleCanWrite(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    return (Console->Frontend != NULL) ?
+           FrontendCanWrite(Console->Frontend) :
+           XENBUS_CONSOLE(CanWrite, &Console->ConsoleInterface);
+}
+
+static FORCEINLINE ULONG
+__ConsoleWrite(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PCHAR               Data,
+    IN  ULONG               Length
+    )
+{
+    return (Console->Frontend != NULL) ?
+           FrontendWrite(Console->Frontend, Data, Length) :
+           XENBUS_CONSOLE(Write, &Console->ConsoleInterface, Data, Length);
+}
+
+// Empty the input ring into the FIFO. This is done on every wakeup,
+// whether or not anyone is reading, so that the backend is never
+// throttled by a slow (or absent) reader. If the FIFO fills then the
+// oldest data is overwritten and counted as dropped.
+static ULONG
+ConsoleFill(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    ULONG                   Filled;
+    ULONG                   Used;
+
+    Filled = 0;
+
+    for (;;) {
+        ULONG   Offset;
+        ULONG   Read;
+        KIRQL   Irql;
+
+        Offset = Console->FifoProducer & (Console->FifoSize - 1);
+
+        KeAcquireSpinLock(&Console->Lock, &Irql);
+
+        Read = (Console->Enabled) ?
+               __ConsoleRead(Console,
+                             &Console->Fifo[Offset],
+                             Console->FifoSize - Offset) :
+               0;
+
+        KeReleaseSpinLock(&Console->Lock, Irql);
+
+        if (Read == 0)
+            break;
+
+        Console->FifoProducer += Read;
+        Filled += Read;
+    }
+
+    Used = Console->FifoProducer - Console->FifoConsumer;
+    if (Used > Console->FifoSize) {
+        ULONG   Dropped = Used - Console->FifoSize;
+
+        Console->FifoConsumer += Dropped;
+        Console->Statistics.ReceiveDropped += Dropped;
+
+        if (!Console->FifoOverflow) {
+            Console->FifoOverflow = TRUE;
+            Console->Statistics.ReceiveOverflows++;
+
+            Warning("receive FIFO overflow (%u overflows, %I64u bytes dropped)\n",
+                    Console->Statistics.ReceiveOverflows,
+                    Console->Statistics.ReceiveDropped);
+        }
+    } else if (Used < Console->FifoSize) {
+        Console->FifoOverflow = FALSE;
+    }
+
+    return Filled;
+}
+
+// Hand a copy of the FIFO contents to every stream that was opened for
+// reading. Each stream makes its own progress: one whose buffer is full
+// drops what it cannot take (and counts it) rather than holding up the
+// rest. If there are no readers the data is left in the FIFO.
+static ULONG
+ConsoleReceive(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    PLIST_ENTRY             ListEntry;
+    ULONG                   Readers;
+    ULONG                   Length;
+    ULONG                   Offset;
+    ULONG                   Count;
+
+    Length = Console->FifoProducer - Console->FifoConsumer;
+    if (Length == 0)
+        return 0;
+
+    Offset = Console->FifoConsumer & (Console->FifoSize - 1);
+    Count = __min(Length, Console->FifoSize - Offset);
+
+    Readers = 0;
+
+    for (ListEntry = Console->List.Flink;
+         ListEntry != &Console->List;
+         ListEntry = ListEntry->Flink) {
+        PCONSOLE_STREAM Entry;
+
+        Entry = CONTAINING_RECORD(ListEntry, CONSOLE_STREAM, ListEntry);
+
+        if (!StreamIsReadable(Entry->Stream))
+            continue;
+
+        Readers++;
+
+        StreamReceive(Entry->Stream, &Console->Fifo[Offset], Count);
+
+        if (Count != Length)
+            StreamReceive(Entry->Stream, Console->Fifo, Length - Count);
+    }
+
+    if (Readers == 0)
+        return 0;
+
+    Console->FifoConsumer += Length;
+
+    return Length;
+}
+
+// Push as much buffered output into the ring as it will take. Priority
+// output always goes first.
+static ULONG
+ConsoleTransmit(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    KIRQL                   Irql;
+    ULONG                   Transmitted;
+
+    Transmitted = 0;
+
+    KeAcquireSpinLock(&Console->Lock, &Irql);
+
+    while (Console->Enabled &&
+           Console->PriorityConsumer != Console->PriorityProducer) {
+        ULONG   Offset;
+        ULONG   Length;
+        ULONG   Written;
+
+        Offset = Console->PriorityConsumer & (CONSOLE_PRIORITY_SIZE - 1);
+        Length = __min(Console->PriorityProducer - Console->PriorityConsumer,
+                       CONSOLE_PRIORITY_SIZE - Offset);
+
+        Written = __ConsoleWrite(Console,
+                                 &Console->PriorityBuffer[Offset],
+                                 Length);
+        if (Written == 0)
+            break;
+
+        Console->PriorityConsumer += Written;
+        Transmitted += Written;
+    }
+
+    while (Console->Enabled &&
+           Console->PriorityConsumer == Console->PriorityProducer &&
+           Console->TransmitConsumer != Console->TransmitProducer) {
+        ULONG   Offset;
+        ULONG   Length;
+        ULONG   Written;
+
+        Offset = (ULONG)(Console->TransmitConsumer &
+                         (Console->TransmitSize - 1));
+        Length = (ULONG)__min(Console->TransmitProducer -
+                              Console->TransmitConsumer,
+                              Console->TransmitSize - Offset);
+
+        Written = __ConsoleWrite(Console,
+                                 &Console->TransmitBuffer[Offset],
+                                 Length);
+        if (Written == 0)
+            break;
+
+        Console->TransmitConsumer += Written;
+        Transmitted += Written;
+    }
+
+    KeReleaseSpinLock(&Console->Lock, Irql);
+
+    return Transmitted;
+}
+
+static BOOLEAN
+ConsoleHasWork(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    KIRQL                   Irql;
+    BOOLEAN                 Work;
+
+    KeAcquireSpinLock(&Console->Lock, &Irql);
+
+    Work = (Console->Enabled &&
+            (__ConsoleCanRead(Console) ||
+             ((Console->PriorityConsumer != Console->PriorityProducer ||
+               Console->TransmitConsumer != Console->TransmitProducer) &&
+              __ConsoleCanWrite(Console)))) ?
+           TRUE :
+           FALSE;
+
+    KeReleaseSpinLock(&Console->Lock, Irql);
+
+    return Work;
+}
+
+// After a pass that made progress, spin for up to the poll window in
+// case more data turns up, rather than paying for an event and a thread
+// wakeup each time during a burst. The window is halved each time it
+// expires with nothing found, so spinning soon stops when the console
+// goes quiet, and is opened back up to the full poll time when it finds
+// work.
+static BOOLEAN
+ConsolePoll(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PKEVENT             Event
+    )
+{
+    LONG64                  Deadline;
+
+    if (Console->PollWindow == 0)
+        return FALSE;
+
+    Deadline = KeQueryPerformanceCounter(NULL).QuadPart +
+               (Console->PollWindow * Console->Frequency) / 1000000;
+
+    do {
+        // The event covers new writes and the thread being alerted.
+        if (KeReadStateEvent(Event) != 0 || ConsoleHasWork(Console)) {
+            Console->PollWindow = Console->PollTime;
+
+            (VOID) InterlockedIncrement64((PLONG64)&Console->Statistics.PollWakeups);
+            return TRUE;
+        }
+
+        YieldProcessor();
+    } while (KeQueryPerformanceCounter(NULL).QuadPart < Deadline);
+
+    Console->PollWindow >>= 1;
+    return FALSE;
+}
+
+static NTSTATUS
+ConsoleWorker(
+    IN  PXENCONS_THREAD     Self,
+    IN  PVOID               Context
+    )
+{
+    PXENCONS_CONSOLE        Console = Context;
+    PKEVENT                 Event;
+    BOOLEAN                 Poll;
+
+    Trace("====>\n");
+
+    Event = ThreadGetEvent(Self);
+    Poll = FALSE;
+
+    for (;;) {
+        ULONG   Transmitted;
+        ULONG   Filled;
+        ULONG   Received;
+        ULONG   Total;
+        BOOLEAN Progress;
+
+        if (!Poll) {
+            LONG64  Idle;
+
+            (VOID) KeWaitForSingleObject(Event,
+                                         Executive,
+                                         KernelMode,
+                                         FALSE,
+                                         NULL);
+
+            // Once polling has switched itself off, turn it back on if
+            // work arrives soon enough after going idle that a spin
+            // would have caught it.
+            Idle = KeQueryPerformanceCounter(NULL).QuadPart -
+                   Console->IdleTime;
+            if (Console->PollWindow == 0 &&
+                Idle < (Console->PollTime * Console->Frequency) / 1000000)
+                Console->PollWindow = Console->PollTime;
+        }
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        ExAcquireFastMutex(&Console->Mutex);
+
+        Transmitted = Filled = Total = 0;
+        Progress = FALSE;
+
+        // Streams drop what they cannot take, so passing data on never
+        // has to wait for a reader. Keep going while the ring has more,
+        // but only for a FIFO's worth at a time: otherwise a flood from
+        // the backend would keep the mutex held, and handles could not
+        // be opened or closed. Writes queued by the poll wake the thread
+        // again, so there is no need to loop for them here.
+        do {
+            PLIST_ENTRY ListEntry;
+
+            Transmitted += ConsoleTransmit(Console);
+            Filled += ConsoleFill(Console);
+
+            Received = ConsoleReceive(Console);
+            Total += Received;
+
+            for (ListEntry = Console->List.Flink;
+                 ListEntry != &Console->List;
+                 ListEntry = ListEntry->Flink) {
+                PCONSOLE_STREAM Entry;
+
+                Entry = CONTAINING_RECORD(ListEntry, CONSOLE_STREAM, ListEntry);
+
+                if (StreamPoll(Entry->Stream))
+                    Progress = TRUE;
+            }
+        } while (Received != 0 && Total < Console->FifoSize);
+
+        // There may be more in the ring, so come straight back for it
+        if (Received != 0)
+            KeSetEvent(Event, IO_NO_INCREMENT, FALSE);
+
+        if (Transmitted != 0 || Filled != 0)
+            Progress = TRUE;
+
+        if (!Progress)
+            (VOID) InterlockedIncrement64((PLONG64)&Console->Statistics.EmptyWakeups);
+
+        TraceEvent(XENCONS_TRACE_WAKEUP, Transmitted, Filled, Total);
+
+        ExReleaseFastMutex(&Console->Mutex);
+
+        Poll = (Progress) ? ConsolePoll(Console, Event) : FALSE;
+
+        if (!Poll)
+            Console->IdleTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
+PXENCONS_STATISTICS
+ConsoleGetStatistics(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    return &Console->Statistics;
+}
+
+PXENCONS_LATENCY
+ConsoleGetLatency(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    return &Console->Latency;
+}
+
+// Size of the buffer each handle keeps for input received ahead of
+// its reads.
+ULONG
+ConsoleGetReadAheadSize(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    return Console->ReadAheadSize;
+}
+
+// Fill in the device's part of the occupancy.
+VOID
+ConsoleQueryOccupancy(
+    IN  PXENCONS_CONSOLE    Console,
+    OUT PXENCONS_OCCUPANCY  Occupancy
+    )
+{
+    KIRQL                   Irql;
+
+    // The FIFO is only changed by the worker thread, and it does not
+    // matter here if the two indices are slightly out of step.
+    Occupancy->ReceivePending = *(volatile ULONG *)&Console->FifoProducer -
+                                *(volatile ULONG *)&Console->FifoConsumer;
+    Occupancy->ReceiveSize = Console->FifoSize;
+
+    KeAcquireSpinLock(&Console->Lock, &Irql);
+
+    Occupancy->WriteSpace = Console->TransmitSize -
+                            (ULONG)(Console->TransmitProducer -
+                                    Console->TransmitConsumer);
+    Occupancy->WriteSize = Console->TransmitSize;
+
+    if (Console->Enabled) {
+        Occupancy->RingReadable = __ConsoleCanRead(Console);
+        Occupancy->RingWritable = __ConsoleCanWrite(Console);
+    } else {
+        Occupancy->RingReadable = FALSE;
+        Occupancy->RingWritable = FALSE;
+    }
+
+    KeReleaseSpinLock(&Console->Lock, Irql);
+}
+
+static VOID
+ConsoleDebugCallback(
+    IN  PVOID               Argument,
+    IN  BOOLEAN             Crashing
+    )
+{
+    PXENCONS_CONSOLE        Console = Argument;
+    PXENCONS_STATISTICS     Statistics = &Console->Statistics;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    XENBUS_DEBUG(Printf,
+                 &Console->DebugInterface,
+                 "PATH: %s\n",
+                 (Console->Frontend != NULL) ?
+                 FrontendGetPath(Console->Frontend) :
+                 "console");
+
+    XENBUS_DEBUG(Printf,
+                 &Console->DebugInterface,
+                 "FIFO: %u/%u bytes%s TRANSMIT: %I64u/%u bytes PRIORITY: %u/%u bytes\n",
+                 Console->FifoProducer - Console->FifoConsumer,
+                 Console->FifoSize,
+                 (Console->FifoOverflow) ? " (OVERFLOW)" : "",
+                 Console->TransmitProducer - Console->TransmitConsumer,
+                 Console->TransmitSize,
+                 Console->PriorityProducer - Console->PriorityConsumer,
+                 CONSOLE_PRIORITY_SIZE);
+
+    XENBUS_DEBUG(Printf,
+                 &Console->DebugInterface,
+                 "READ: %I64u bytes %I64u requests WRITE: %I64u bytes %I64u requests\n",
+                 Statistics->BytesRead,
+                 Statistics->ReadsCompleted,
+                 Statistics->BytesWritten,
+                 Statistics->WritesCompleted);
+
+    XENBUS_DEBUG(Printf,
+                 &Console->DebugInterface,
+                 "CANCELLED: %I64u BLOCKED: %I64u EMPTY WAKEUPS: %I64u\n",
+                 Statistics->RequestsCancelled,
+                 Statistics->RequestsBlocked,
+                 Statistics->EmptyWakeups);
+
+    XENBUS_DEBUG(Printf,
+                 &Console->DebugInterface,
+                 "POLL: %u/%u us (%I64u wakeups)\n",
+                 Console->PollWindow,
+                 Console->PollTime,
+                 Statistics->PollWakeups);
+
+    XENBUS_DEBUG(Printf,
+                 &Console->DebugInterface,
+                 "DROPPED: %I64u bytes (%u overflows) HIGH WATER: READ %u WRITE %u\n",
+                 Statistics->ReceiveDropped,
+                 Statistics->ReceiveOverflows,
+                 Statistics->ReadQueueHighWater,
+                 Statistics->WriteQueueHighWater);
+}
+
+VOID
+ConsoleWake(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    ThreadWake(Console->Thread);
+}
+
+// While the lock is held the worker thread is not touching any stream.
+VOID
+ConsoleAcquireLock(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    ExAcquireFastMutex(&Console->Mutex);
+}
+
+VOID
+ConsoleReleaseLock(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    ExReleaseFastMutex(&Console->Mutex);
+}
+
+// Copy data into the transmit buffer, to be pushed into the ring by the
+// worker thread. If nothing is already buffered then as much as possible
+// goes straight into the ring first. A write that fits in the buffer is
+// taken whole or not at all, so that writes from different handles are
+// not interleaved. Sequence is set to the position in the output stream
+// that must be reached for the data to have been transmitted.
+ULONG
+ConsoleWrite(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PCHAR               Buffer,
+    IN  ULONG               Length,
+    OUT PULONG64            Sequence
+    )
+{
+    KIRQL                   Irql;
+    ULONG                   Direct;
+    ULONG                   Space;
+    ULONG                   Written;
+
+    KeAcquireSpinLock(&Console->Lock, &Irql);
+
+    Direct = (Console->Enabled &&
+              Console->PriorityProducer == Console->PriorityConsumer &&
+              Console->TransmitProducer == Console->TransmitConsumer) ?
+             __ConsoleWrite(Console, Buffer, Length) :
+             0;
+
+    Console->TransmitProducer += Direct;
+    Console->TransmitConsumer += Direct;
+    Buffer += Direct;
+    Length -= Direct;
+
+    Space = Console->TransmitSize -
+            (ULONG)(Console->TransmitProducer - Console->TransmitConsumer);
+
+    if (Length > Console->TransmitSize)
+        Written = Space;
+    else if (Length > Space)
+        Written = 0;
+    else
+        Written = Length;
+
+    Length = Written;
+
+    while (Length != 0) {
+        ULONG   Offset;
+        ULONG   Count;
+
+        Offset = (ULONG)(Console->TransmitProducer &
+                         (Console->TransmitSize - 1));
+        Count = __min(Length, Console->TransmitSize - Offset);
+
+        RtlCopyMemory(&Console->TransmitBuffer[Offset], Buffer, Count);
+
+        Console->TransmitProducer += Count;
+        Buffer += Count;
+        Length -= Count;
+    }
+
+    *Sequence = Console->TransmitProducer;
+
+    KeReleaseSpinLock(&Console->Lock, Irql);
+
+    if (Written != 0)
+        ThreadWake(Console->Thread);
+
+    return Direct + Written;
+}
+
+// Priority output goes ahead of anything already buffered, and is
+// buffered whole or not at all.
+BOOLEAN
+ConsoleWritePriority(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PCHAR               Buffer,
+    IN  ULONG               Length
+    )
+{
+    KIRQL                   Irql;
+    ULONG                   Direct;
+    BOOLEAN                 Accepted;
+    ULONG                   Buffered;
+
+    ASSERT3U(Length, <=, CONSOLE_PRIORITY_SIZE);
+
+    KeAcquireSpinLock(&Console->Lock, &Irql);
+
+    Direct = (Console->Enabled &&
+              Console->PriorityProducer == Console->PriorityConsumer) ?
+             __ConsoleWrite(Console, Buffer, Length) :
+             0;
+
+    Buffer += Direct;
+    Length -= Direct;
+
+    Accepted = (Length <= CONSOLE_PRIORITY_SIZE -
+                          (Console->PriorityProducer -
+                           Console->PriorityConsumer)) ?
+               TRUE :
+               FALSE;
+
+    // A direct write only happens with the buffer empty, so the rest of
+    // the write will always fit.
+    ASSERT(Accepted || Direct == 0);
+
+    Buffered = (Accepted) ? Length : 0;
+    Length = Buffered;
+
+    while (Length != 0) {
+        ULONG   Offset;
+        ULONG   Count;
+
+        Offset = Console->PriorityProducer & (CONSOLE_PRIORITY_SIZE - 1);
+        Count = __min(Length, CONSOLE_PRIORITY_SIZE - Offset);
+
+        RtlCopyMemory(&Console->PriorityBuffer[Offset], Buffer, Count);
+
+        Console->PriorityProducer += Count;
+        Buffer += Count;
+        Length -= Count;
+    }
+
+    KeReleaseSpinLock(&Console->Lock, Irql);
+
+    if (Buffered != 0)
+        ThreadWake(Console->Thread);
+
+    return Accepted;
+}
+
+BOOLEAN
+ConsoleIsTransmitted(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  ULONG64             Sequence
+    )
+{
+    KIRQL                   Irql;
+    BOOLEAN                 Transmitted;
+
+    KeAcquireSpinLock(&Console->Lock, &Irql);
+    Transmitted = (Console->TransmitConsumer >= Sequence);
+    KeReleaseSpinLock(&Console->Lock, Irql);
+
+    return Transmitted;
+}
+
+NTSTATUS
+ConsoleAddStream(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PXENCONS_STREAM     Stream
+    )
+{
+    PCONSOLE_STREAM         Entry;
+    NTSTATUS                status;
+
+    Entry = __ConsoleAllocate(sizeof (CONSOLE_STREAM));
+
+    status = STATUS_NO_MEMORY;
+    if (Entry == NULL)
+        goto fail1;
+
+    Entry->Stream = Stream;
+
+    ExAcquireFastMutex(&Console->Mutex);
+    InsertTailList(&Console->List, &Entry->ListEntry);
+    ExReleaseFastMutex(&Console->Mutex);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Once this returns the worker thread will not touch the stream again.
+VOID
+ConsoleRemoveStream(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PXENCONS_STREAM     Stream
+    )
+{
+    PLIST_ENTRY             ListEntry;
+    PCONSOLE_STREAM         Entry;
+
+    ExAcquireFastMutex(&Console->Mutex);
+
+    for (ListEntry = Console->List.Flink;
+         ListEntry != &Console->List;
+         ListEntry = ListEntry->Flink) {
+        Entry = CONTAINING_RECORD(ListEntry, CONSOLE_STREAM, ListEntry);
+
+        if (Entry->Stream == Stream)
+            goto found;
+    }
+
+    ExReleaseFastMutex(&Console->Mutex);
+
+    ASSERT(FALSE);
+    return;
+
+found:
+    RemoveEntryList(&Entry->ListEntry);
+
+    ExReleaseFastMutex(&Console->Mutex);
+
+    RtlZeroMemory(&Entry->ListEntry, sizeof (LIST_ENTRY));
+    Entry->Stream = NULL;
+
+    ASSERT(IsZeroMemory(Entry, sizeof (CONSOLE_STREAM)));
+    __ConsoleFree(Entry);
+}
+
+// Have the ring signal the worker thread's event.
+static NTSTATUS
+ConsoleConnect(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    NTSTATUS                status;
+
+    if (Console->Frontend != NULL)
+        return FrontendConnect(Console->Frontend,
+                               ThreadGetEvent(Console->Thread));
+
+    status = XENBUS_CONSOLE(Acquire, &Console->ConsoleInterface);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = XENBUS_CONSOLE(WakeupAdd,
+                            &Console->ConsoleInterface,
+                            ThreadGetEvent(Console->Thread),
+                            &Console->Wakeup);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    XENBUS_CONSOLE(Release, &Console->ConsoleInterface);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+ConsoleDisconnect(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    if (Console->Frontend != NULL) {
+        FrontendDisconnect(Console->Frontend);
+        return;
+    }
+
+    XENBUS_CONSOLE(WakeupRemove,
+                   &Console->ConsoleInterface,
+                   Console->Wakeup);
+    Console->Wakeup = NULL;
+
+    XENBUS_CONSOLE(Release, &Console->ConsoleInterface);
+}
+
+NTSTATUS
+ConsoleEnable(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    Trace("====>\n");
+
+    status = ConsoleConnect(Console);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = XENBUS_DEBUG(Acquire, &Console->DebugInterface);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_DEBUG(Register,
+                          &Console->DebugInterface,
+                          __MODULE__ "|CONSOLE",
+                          ConsoleDebugCallback,
+                          Console,
+                          &Console->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    KeAcquireSpinLock(&Console->Lock, &Irql);
+    Console->Enabled = TRUE;
+    KeReleaseSpinLock(&Console->Lock, Irql);
+
+    ThreadWake(Console->Thread);
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    XENBUS_DEBUG(Release, &Console->DebugInterface);
+
+fail2:
+    Error("fail2\n");
+
+    ConsoleDisconnect(Console);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+ConsoleDisable(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    KIRQL                   Irql;
+
+    Trace("====>\n");
+
+    KeAcquireSpinLock(&Console->Lock, &Irql);
+    Console->Enabled = FALSE;
+    KeReleaseSpinLock(&Console->Lock, Irql);
+
+    XENBUS_DEBUG(Deregister,
+                 &Console->DebugInterface,
+                 Console->DebugCallback);
+    Console->DebugCallback = NULL;
+
+    XENBUS_DEBUG(Release, &Console->DebugInterface);
+
+    ConsoleDisconnect(Console);
+
+    Trace("<====\n");
+}
+
+// Buffer sizes are taken from the named value under the driver's
+// Parameters key, rounded up to a power of two.
+static ULONG
+ConsoleGetBufferSize(
+    IN  PCHAR   Name,
+    IN  ULONG   Default
+    )
+{
+    HANDLE                  ParametersKey;
+    ULONG                   Value;
+    ULONG                   Size;
+    NTSTATUS                status;
+
+    ParametersKey = DriverGetParametersKey();
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     Name,
+                                     &Value);
+    if (!NT_SUCCESS(status))
+        Value = Default;
+
+    Value = __max(Value, CONSOLE_FIFO_SIZE_MINIMUM);
+    Value = __min(Value, CONSOLE_FIFO_SIZE_MAXIMUM);
+
+    Size = CONSOLE_FIFO_SIZE_MINIMUM;
+    while (Size < Value)
+        Size <<= 1;
+
+    return Size;
+}
+
+// The time the worker spends polling after a burst is taken from the
+// PollTime value (in microseconds) under the driver's Parameters key. A
+// value of zero turns polling off.
+static ULONG
+ConsoleGetPollTime(
+    VOID
+    )
+{
+    HANDLE                  ParametersKey;
+    ULONG                   Value;
+    NTSTATUS                status;
+
+    ParametersKey = DriverGetParametersKey();
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "PollTime",
+                                     &Value);
+    if (!NT_SUCCESS(status))
+        Value = CONSOLE_POLL_TIME_DEFAULT;
+
+    return __min(Value, CONSOLE_POLL_TIME_MAXIMUM);
+}
+
+// If Frontend is NULL this is the primary console.
+NTSTATUS
+ConsoleCreate(
+    IN  PXENCONS_FDO        Fdo,
+    IN  PXENCONS_FRONTEND   Frontend OPTIONAL,
+    OUT PXENCONS_CONSOLE    *Console
+    )
+{
+    LARGE_INTEGER           Frequency;
+    NTSTATUS                status;
+
+    *Console = __ConsoleAllocate(sizeof (XENCONS_CONSOLE));
+
+    status = STATUS_NO_MEMORY;
+    if (*Console == NULL)
+        goto fail1;
+
+    FdoGetDebugInterface(Fdo, &(*Console)->DebugInterface);
+    FdoGetConsoleInterface(Fdo, &(*Console)->ConsoleInterface);
+    (*Console)->Frontend = Frontend;
+
+    (*Console)->FifoSize = ConsoleGetBufferSize("ReceiveBufferSize",
+                                                CONSOLE_FIFO_SIZE_DEFAULT);
+    (*Console)->Fifo = __ConsoleAllocate((*Console)->FifoSize);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Console)->Fifo == NULL)
+        goto fail2;
+
+    (*Console)->TransmitSize = ConsoleGetBufferSize("TransmitBufferSize",
+                                                    CONSOLE_FIFO_SIZE_DEFAULT);
+    (*Console)->TransmitBuffer = __ConsoleAllocate((*Console)->TransmitSize);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Console)->TransmitBuffer == NULL)
+        goto fail3;
+
+    (*Console)->ReadAheadSize =
+        ConsoleGetBufferSize("ReadAheadSize",
+                             CONSOLE_READ_AHEAD_SIZE_DEFAULT);
+
+    Info("receive FIFO: %u bytes transmit buffer: %u bytes read-ahead: %u bytes\n",
+         (*Console)->FifoSize,
+         (*Console)->TransmitSize,
+         (*Console)->ReadAheadSize);
+
+    (*Console)->PollTime = ConsoleGetPollTime();
+    (*Console)->PollWindow = (*Console)->PollTime;
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+    (*Console)->Frequency = Frequency.QuadPart;
+
+    Info("poll: %u us\n", (*Console)->PollTime);
+
+    ExInitializeFastMutex(&(*Console)->Mutex);
+    InitializeListHead(&(*Console)->List);
+    KeInitializeSpinLock(&(*Console)->Lock);
+
+    status = ThreadCreate(ConsoleWorker,
+                          *Console,
+                          &(*Console)->Thread);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    (*Console)->Fdo = Fdo;
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+    (*Console)->Frequency = 0;
+    (*Console)->PollWindow = 0;
+    (*Console)->PollTime = 0;
+    (*Console)->ReadAheadSize = 0;
+
+    RtlZeroMemory(&(*Console)->Lock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&(*Console)->List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Console)->Mutex, sizeof (FAST_MUTEX));
+
+    __ConsoleFree((*Console)->TransmitBuffer);
+    (*Console)->TransmitBuffer = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    (*Console)->TransmitSize = 0;
+
+    __ConsoleFree((*Console)->Fifo);
+    (*Console)->Fifo = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    (*Console)->FifoSize = 0;
+
+    (*Console)->Frontend = NULL;
+
+    RtlZeroMemory(&(*Console)->ConsoleInterface,
+                  sizeof (XENBUS_CONSOLE_INTERFACE));
+
+    RtlZeroMemory(&(*Console)->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
+    ASSERT(IsZeroMemory(*Console, sizeof (XENCONS_CONSOLE)));
+    __ConsoleFree(*Console);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+ConsoleDestroy(
+    IN  PXENCONS_CONSOLE    Console
+    )
+{
+    ASSERT(!Console->Enabled);
+
+    Console->Fdo = NULL;
+
+    ThreadAlert(Console->Thread);
+    ThreadJoin(Console->Thread);
+    Console->Thread = NULL;
+
+    Console->IdleTime = 0;
+    Console->Frequency = 0;
+    Console->PollWindow = 0;
+    Console->PollTime = 0;
+
+    Console->PriorityConsumer = 0;
+    Console->PriorityProducer = 0;
+    RtlZeroMemory(Console->PriorityBuffer, CONSOLE_PRIORITY_SIZE);
+
+    Console->ReadAheadSize = 0;
+
+    Console->TransmitConsumer = 0;
+    Console->TransmitProducer = 0;
+
+    __ConsoleFree(Console->TransmitBuffer);
+    Console->TransmitBuffer = NULL;
+    Console->TransmitSize = 0;
+
+    RtlZeroMemory(&Console->Latency, sizeof (XENCONS_LATENCY));
+    RtlZeroMemory(&Console->Statistics, sizeof (XENCONS_STATISTICS));
+
+    Console->FifoOverflow = FALSE;
+    Console->FifoConsumer = 0;
+    Console->FifoProducer = 0;
+
+    __ConsoleFree(Console->Fifo);
+    Console->Fifo = NULL;
+    Console->FifoSize = 0;
+
+    RtlZeroMemory(&Console->Lock, sizeof (KSPIN_LOCK));
+
+    ASSERT(IsListEmpty(&Console->List));
+    RtlZeroMemory(&Console->List, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(&Console->Mutex, sizeof (FAST_MUTEX));
+
+    Console->Frontend = NULL;
+
+    RtlZeroMemory(&Console->ConsoleInterface,
+                  sizeof (XENBUS_CONSOLE_INTERFACE));
+
+    RtlZeroMemory(&Console->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
+    ASSERT(IsZeroMemory(Console, sizeof (XENCONS_CONSOLE)));
+    __ConsoleFree(Console);
+}
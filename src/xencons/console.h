@@ -0,0 +1,135 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENCONS_CONSOLE_H
+#define _XENCONS_CONSOLE_H
+
+#include <ntddk.h>
+#include <xencons_device.h>
+
+typedef struct _XENCONS_CONSOLE XENCONS_CONSOLE, *PXENCONS_CONSOLE;
+
+#include "fdo.h"
+#include "frontend.h"
+#include "stream.h"
+
+extern NTSTATUS
+ConsoleCreate(
+    IN  PXENCONS_FDO        Fdo,
+    IN  PXENCONS_FRONTEND   Frontend OPTIONAL,
+    OUT PXENCONS_CONSOLE    *Console
+    );
+
+extern VOID
+ConsoleDestroy(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern NTSTATUS
+ConsoleEnable(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern VOID
+ConsoleDisable(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern NTSTATUS
+ConsoleAddStream(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PXENCONS_STREAM     Stream
+    );
+
+extern VOID
+ConsoleRemoveStream(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PXENCONS_STREAM     Stream
+    );
+
+extern PXENCONS_STATISTICS
+ConsoleGetStatistics(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern PXENCONS_LATENCY
+ConsoleGetLatency(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern ULONG
+ConsoleGetReadAheadSize(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern VOID
+ConsoleQueryOccupancy(
+    IN  PXENCONS_CONSOLE    Console,
+    OUT PXENCONS_OCCUPANCY  Occupancy
+    );
+
+extern VOID
+ConsoleWake(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern VOID
+ConsoleAcquireLock(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern VOID
+ConsoleReleaseLock(
+    IN  PXENCONS_CONSOLE    Console
+    );
+
+extern ULONG
+ConsoleWrite(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PCHAR               Buffer,
+    IN  ULONG               Length,
+    OUT PULONG64            Sequence
+    );
+
+extern BOOLEAN
+ConsoleWritePriority(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PCHAR               Buffer,
+    IN  ULONG               Length
+    );
+
+extern BOOLEAN
+ConsoleIsTransmitted(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  ULONG64             Sequence
+    );
+
+#endif  // _XENCONS_CONSOLE_H
@@ -35,6 +35,8 @@
 #include <version.h>
 
 #include "registry.h"
+#include "trace.h"
+#include "stream.h"
 #include "fdo.h"
 #include "driver.h"
 #include "dbg_print.h"
@@ -134,6 +136,10 @@ DriverUnload(
 
     RegistryTeardown();
 
+    StreamTeardown();
+
+    TraceTeardown();
+
     Info("XENCONS %d.%d.%d (%d) (%02d.%02d.%04d)\n",
          MAJOR_VERSION,
          MINOR_VERSION,
@@ -250,20 +256,28 @@ DriverEntry(
          MONTH,
          YEAR);
 
-    status = RegistryInitialize(RegistryPath);
+    status = TraceInitialize();
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    status = RegistryOpenServiceKey(KEY_ALL_ACCESS, &ServiceKey);
+    status = StreamInitialize();
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    status = RegistryInitialize(RegistryPath);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    status = RegistryOpenServiceKey(KEY_ALL_ACCESS, &ServiceKey);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
     status = RegistryOpenSubKey(ServiceKey,
                                 "Parameters",
                                 KEY_READ,
                                 &ParametersKey);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail5;
 
     __DriverSetParametersKey(ParametersKey);
 
@@ -281,15 +295,25 @@ DriverEntry(
 
     return STATUS_SUCCESS;
 
+fail5:
+    Error("fail5\n");
+
+    RegistryCloseKey(ServiceKey);
+
+fail4:
+    Error("fail4\n");
+
+    RegistryTeardown();
+
 fail3:
     Error("fail3\n");
 
-    RegistryCloseKey(ServiceKey);
+    StreamTeardown();
 
 fail2:
     Error("fail2\n");
 
-    RegistryTeardown();
+    TraceTeardown();
 
 fail1:
     Error("fail1 (%08x)\n", status);
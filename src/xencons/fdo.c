@@ -41,14 +41,18 @@
 #include <suspend_interface.h>
 #include <store_interface.h>
 #include <console_interface.h>
+#include <evtchn_interface.h>
+#include <gnttab_interface.h>
 #include <xencons_device.h>
 #include <version.h>
 
 #include "driver.h"
 #include "registry.h"
 #include "fdo.h"
+#include "frontend.h"
 #include "stream.h"
 #include "thread.h"
+#include "trace.h"
 #include "names.h"
 #include "dbg_print.h"
 #include "assert.h"
@@ -75,6 +79,16 @@ typedef struct _FDO_HANDLE {
     PXENCONS_STREAM Stream;
 } FDO_HANDLE, *PFDO_HANDLE;
 
+typedef struct _FDO_CONSOLE {
+    PXENCONS_FRONTEND   Frontend;
+    PXENCONS_CONSOLE    Console;
+    UNICODE_STRING      Name;
+    UNICODE_STRING      Link;
+    BOOLEAN             Enabled;
+} FDO_CONSOLE, *PFDO_CONSOLE;
+
+#define FDO_MAXIMUM_CONSOLES    8
+
 struct _XENCONS_FDO {
     PXENCONS_DX                 Dx;
     PDEVICE_OBJECT              LowerDeviceObject;
@@ -88,6 +102,11 @@ struct _XENCONS_FDO {
     PIRP                        SystemPowerIrp;
     PXENCONS_THREAD             DevicePowerThread;
     PIRP                        DevicePowerIrp;
+    PXENCONS_THREAD             DistributionThread;
+    LONG                        DistributionRequested;
+    LONG                        DistributionCompleted;
+    ULONG64                     DistributionTime;
+    FAST_MUTEX                  Mutex;
 
     CHAR                        VendorName[MAXNAMELEN];
 
@@ -100,8 +119,22 @@ struct _XENCONS_FDO {
     XENBUS_SUSPEND_INTERFACE    SuspendInterface;
     XENBUS_STORE_INTERFACE      StoreInterface;
     XENBUS_CONSOLE_INTERFACE    ConsoleInterface;
+    XENBUS_EVTCHN_INTERFACE     EvtchnInterface;
+    XENBUS_GNTTAB_INTERFACE     GnttabInterface;
 
+    PXENBUS_DEBUG_CALLBACK      DebugCallback;
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackLate;
+    LONG                        Distribution;
+
+    XENCONS_RESUME_SAMPLE       Sample;
+    ULONG64                     SampleStart;
+    XENCONS_RESUME_SAMPLE       Timing[XENCONS_RESUME_SAMPLES];
+    ULONG                       TimingCount;
+    KSPIN_LOCK                  TimingLock;
+
+    PXENCONS_CONSOLE            Console;
+    FDO_CONSOLE                 Secondary[FDO_MAXIMUM_CONSOLES];
+    ULONG                       SecondaryCount;
 };
 
 static FORCEINLINE PVOID
@@ -494,84 +527,6 @@ FdoParseResources(
     }
 }
 
-static FORCEINLINE PANSI_STRING
-__FdoMultiSzToUpcaseAnsi(
-    IN  PCHAR       Buffer
-    )
-{
-    PANSI_STRING    Ansi;
-    LONG            Index;
-    LONG            Count;
-    NTSTATUS        status;
-
-    Index = 0;
-    Count = 0;
-    for (;;) {
-        if (Buffer[Index] == '\0') {
-            Count++;
-            Index++;
-
-            // Check for double NUL
-            if (Buffer[Index] == '\0')
-                break;
-        } else {
-            Buffer[Index] = __toupper(Buffer[Index]);
-            Index++;
-        }
-    }
-
-    Ansi = __FdoAllocate(sizeof (ANSI_STRING) * (Count + 1));
-
-    status = STATUS_NO_MEMORY;
-    if (Ansi == NULL)
-        goto fail1;
-
-    for (Index = 0; Index < Count; Index++) {
-        ULONG   Length;
-
-        Length = (ULONG)strlen(Buffer);
-        Ansi[Index].MaximumLength = (USHORT)(Length + 1);
-        Ansi[Index].Buffer = __FdoAllocate(Ansi[Index].MaximumLength);
-
-        status = STATUS_NO_MEMORY;
-        if (Ansi[Index].Buffer == NULL)
-            goto fail2;
-
-        RtlCopyMemory(Ansi[Index].Buffer, Buffer, Length);
-        Ansi[Index].Length = (USHORT)Length;
-
-        Buffer += Length + 1;
-    }
-
-    return Ansi;
-
-fail2:
-    Error("fail2\n");
-
-    while (--Index >= 0)
-        __FdoFree(Ansi[Index].Buffer);
-
-    __FdoFree(Ansi);
-
-fail1:
-    Error("fail1 (%08x)\n", status);
-
-    return NULL;
-}
-
-static FORCEINLINE VOID
-__FdoFreeAnsi(
-    IN  PANSI_STRING    Ansi
-    )
-{
-    ULONG               Index;
-
-    for (Index = 0; Ansi[Index].Buffer != NULL; Index++)
-        __FdoFree(Ansi[Index].Buffer);
-
-    __FdoFree(Ansi);
-}
-
 static FORCEINLINE BOOLEAN
 __FdoMatchDistribution(
     IN  PXENCONS_FDO    Fdo,
@@ -632,125 +587,386 @@ fail1:
     return FALSE;
 }
 
+// Microseconds, for timing power transitions
+static FORCEINLINE ULONG64
+__FdoGetTime(
+    VOID
+    )
+{
+    LARGE_INTEGER   Counter;
+    LARGE_INTEGER   Frequency;
+
+    Counter = KeQueryPerformanceCounter(&Frequency);
+
+    return ((Counter.QuadPart / Frequency.QuadPart) * 1000000ull) +
+           (((Counter.QuadPart % Frequency.QuadPart) * 1000000ull) /
+            Frequency.QuadPart);
+}
+
+// Transitions are serialized, so the sample being built needs no lock.
+// Only the ring of completed samples is shared with readers.
+static FORCEINLINE VOID
+__FdoTimingStart(
+    IN  PXENCONS_FDO    Fdo,
+    IN  ULONG           Transition
+    )
+{
+    LARGE_INTEGER       SystemTime;
+
+    RtlZeroMemory(&Fdo->Sample, sizeof (XENCONS_RESUME_SAMPLE));
+
+    KeQuerySystemTime(&SystemTime);
+
+    Fdo->Sample.Transition = Transition;
+    Fdo->Sample.SystemTime = SystemTime.QuadPart;
+    Fdo->SampleStart = __FdoGetTime();
+}
+
+static FORCEINLINE VOID
+__FdoTimingPhase(
+    IN  PXENCONS_FDO    Fdo,
+    IN  ULONG           Phase,
+    IN  ULONG64         Start
+    )
+{
+    ASSERT3U(Phase, <, XENCONS_PHASES);
+
+    Fdo->Sample.Phase[Phase] += (ULONG)(__FdoGetTime() - Start);
+}
+
 static VOID
-FdoClearDistribution(
+FdoTimingEnd(
     IN  PXENCONS_FDO    Fdo
     )
 {
-    PCHAR               Buffer;
-    PANSI_STRING        Distributions;
-    ULONG               Index;
-    NTSTATUS            status;
+    PXENCONS_RESUME_SAMPLE  Sample = &Fdo->Sample;
+    KIRQL                   Irql;
+
+    Sample->Total = (ULONG)(__FdoGetTime() - Fdo->SampleStart);
+
+    KeAcquireSpinLock(&Fdo->TimingLock, &Irql);
+
+    Sample->Sequence = Fdo->TimingCount++;
+    Fdo->Timing[Sample->Sequence % XENCONS_RESUME_SAMPLES] = *Sample;
+
+    KeReleaseSpinLock(&Fdo->TimingLock, Irql);
+}
+
+NTSTATUS
+FdoQueryResumeTiming(
+    IN  PXENCONS_FDO        Fdo,
+    IN  PIRP                Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   Length;
+    PXENCONS_RESUME_TIMING  Timing;
+    ULONG                   Count;
+    ULONG                   Index;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (Length < sizeof (XENCONS_RESUME_TIMING))
+        goto fail1;
+
+    Timing = Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(Timing, sizeof (XENCONS_RESUME_TIMING));
+
+    KeAcquireSpinLock(&Fdo->TimingLock, &Irql);
+
+    Count = __min(Fdo->TimingCount, XENCONS_RESUME_SAMPLES);
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG   Sequence = Fdo->TimingCount - Count + Index;
+
+        Timing->Sample[Index] =
+            Fdo->Timing[Sequence % XENCONS_RESUME_SAMPLES];
+    }
+
+    KeReleaseSpinLock(&Fdo->TimingLock, Irql);
+
+    Timing->Count = Count;
+
+    Irp->IoStatus.Information = sizeof (XENCONS_RESUME_TIMING);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static const CHAR *
+FdoTransitionName(
+    IN  ULONG   Transition
+    )
+{
+#define _FDO_TRANSITION_NAME(_Transition)       \
+    case XENCONS_TRANSITION_ ## _Transition:    \
+        return #_Transition;
+
+    switch (Transition) {
+    _FDO_TRANSITION_NAME(D3_TO_D0);
+    _FDO_TRANSITION_NAME(D0_TO_D3);
+    _FDO_TRANSITION_NAME(RESUME);
+    default:
+        break;
+    }
+
+    return "UNKNOWN";
+
+#undef  _FDO_TRANSITION_NAME
+}
+
+static VOID
+FdoDebugCallback(
+    IN  PVOID       Argument,
+    IN  BOOLEAN     Crashing
+    )
+{
+    PXENCONS_FDO    Fdo = Argument;
+    ULONG           Count;
+    ULONG           Index;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    for (Index = 0; Index < Fdo->SecondaryCount; Index++) {
+        PFDO_CONSOLE    Console = &Fdo->Secondary[Index];
+
+        XENBUS_DEBUG(Printf,
+                     &Fdo->DebugInterface,
+                     "%s: %s\n",
+                     FrontendGetPath(Console->Frontend),
+                     (Console->Enabled) ? "ENABLED" : "DISABLED");
+    }
+
+    // The lock cannot be taken here (we may be crashing), so a sample
+    // being recorded concurrently may be shown torn
+    Count = __min(Fdo->TimingCount, XENCONS_RESUME_SAMPLES);
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG                   Sequence = Fdo->TimingCount - Count + Index;
+        PXENCONS_RESUME_SAMPLE  Sample;
+
+        Sample = &Fdo->Timing[Sequence % XENCONS_RESUME_SAMPLES];
+
+        XENBUS_DEBUG(Printf,
+                     &Fdo->DebugInterface,
+                     "%u: %s %u us (CONSOLE: %u/%u INTERFACE: %u/%u DISTRIBUTION: %u/%u/%u DEFERRAL: %u)\n",
+                     Sample->Sequence,
+                     FdoTransitionName(Sample->Transition),
+                     Sample->Total,
+                     Sample->Phase[XENCONS_PHASE_CONSOLE_ENABLE],
+                     Sample->Phase[XENCONS_PHASE_CONSOLE_DISABLE],
+                     Sample->Phase[XENCONS_PHASE_INTERFACE_ACQUIRE],
+                     Sample->Phase[XENCONS_PHASE_INTERFACE_RELEASE],
+                     Sample->Phase[XENCONS_PHASE_DISTRIBUTION_CLEAR],
+                     Sample->Phase[XENCONS_PHASE_DISTRIBUTION_SET],
+                     Sample->Phase[XENCONS_PHASE_DISTRIBUTION_COMMIT],
+                     Sample->Phase[XENCONS_PHASE_DEFERRAL]);
+    }
+}
+
+#define MAXIMUM_INDEX   255
+
+static FORCEINLINE BOOLEAN
+__FdoParseDistribution(
+    IN  PCHAR   Name,
+    OUT PULONG  Index
+    )
+{
+    ULONG       Value;
+
+    if (*Name == '\0')
+        return FALSE;
+
+    Value = 0;
+    while (*Name != '\0') {
+        if (!isdigit((UCHAR)*Name))
+            return FALSE;
+
+        Value = (Value * 10) + (*Name - '0');
+        if (Value > MAXIMUM_INDEX)
+            return FALSE;
+
+        Name++;
+    }
+
+    *Index = Value;
+    return TRUE;
+}
+
+static VOID
+FdoClearDistribution(
+    IN  PXENCONS_FDO                Fdo,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction
+    )
+{
+    CHAR                            Distribution[MAXNAMELEN];
+    PCHAR                           Buffer;
+    PCHAR                           Name;
+    NTSTATUS                        status;
 
     Trace("====>\n");
 
-    status = XENBUS_STORE(Directory,
-                          &Fdo->StoreInterface,
-                          NULL,
-                          NULL,
-                          "drivers",
-                          &Buffer);
-    if (NT_SUCCESS(status)) {
-        Distributions = __FdoMultiSzToUpcaseAnsi(Buffer);
+    // Once we have a slot of our own only that one is removed (and only
+    // if it still carries our entry), so a resume costs a single read.
+    if (Fdo->Distribution >= 0) {
+        status = RtlStringCbPrintfA(Distribution,
+                                    MAXNAMELEN,
+                                    "%u",
+                                    Fdo->Distribution);
+        ASSERT(NT_SUCCESS(status));
+
+        status = XENBUS_STORE(Read,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              "drivers",
+                              Distribution,
+                              &Buffer);
+        if (!NT_SUCCESS(status))
+            goto done;
+
+        if (__FdoMatchDistribution(Fdo, Buffer))
+            (VOID) XENBUS_STORE(Remove,
+                                &Fdo->StoreInterface,
+                                Transaction,
+                                "drivers",
+                                Distribution);
 
         XENBUS_STORE(Free,
                      &Fdo->StoreInterface,
                      Buffer);
-    } else {
-        Distributions = NULL;
+
+        goto done;
     }
 
-    if (Distributions == NULL)
+    // Before that, every entry carrying our vendor and product is swept
+    // away, so that entries left behind by an earlier instance (e.g.
+    // before a crash) do not accumulate. This happens once, on the
+    // first D3 to D0 transition.
+    status = XENBUS_STORE(Directory,
+                          &Fdo->StoreInterface,
+                          Transaction,
+                          NULL,
+                          "drivers",
+                          &Buffer);
+    if (!NT_SUCCESS(status))
         goto done;
 
-    for (Index = 0; Distributions[Index].Buffer != NULL; Index++) {
-        PANSI_STRING    Distribution = &Distributions[Index];
+    for (Name = Buffer; *Name != '\0'; Name += strlen(Name) + 1) {
+        PCHAR   Entry;
 
         status = XENBUS_STORE(Read,
                               &Fdo->StoreInterface,
-                              NULL,
+                              Transaction,
                               "drivers",
-                              Distribution->Buffer,
-                              &Buffer);
+                              Name,
+                              &Entry);
         if (!NT_SUCCESS(status))
             continue;
 
-        if (__FdoMatchDistribution(Fdo, Buffer))
+        if (__FdoMatchDistribution(Fdo, Entry))
             (VOID) XENBUS_STORE(Remove,
                                 &Fdo->StoreInterface,
-                                NULL,
+                                Transaction,
                                 "drivers",
-                                Distribution->Buffer);
+                                Name);
 
         XENBUS_STORE(Free,
                      &Fdo->StoreInterface,
-                     Buffer);
+                     Entry);
     }
 
-    __FdoFreeAnsi(Distributions);
+    XENBUS_STORE(Free,
+                 &Fdo->StoreInterface,
+                 Buffer);
 
 done:
     Trace("<====\n");
 }
 
-#define MAXIMUM_INDEX   255
-
 static NTSTATUS
 FdoSetDistribution(
-    IN  PXENCONS_FDO    Fdo
+    IN  PXENCONS_FDO                Fdo,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction,
+    OUT PULONG                      Index
     )
 {
-    ULONG               Index;
-    CHAR                Distribution[MAXNAMELEN];
-    CHAR                Vendor[MAXNAMELEN];
-    const CHAR          *Product;
-    NTSTATUS            status;
+    ULONG                           Used[(MAXIMUM_INDEX + 1) / 32];
+    PCHAR                           Buffer;
+    CHAR                            Distribution[MAXNAMELEN];
+    CHAR                            Vendor[MAXNAMELEN];
+    const CHAR                      *Product;
+    ULONG                           Slot;
+    ULONG                           Offset;
+    NTSTATUS                        status;
 
     Trace("====>\n");
 
-    Index = 0;
-    while (Index <= MAXIMUM_INDEX) {
-        PCHAR   Buffer;
-
-        status = RtlStringCbPrintfA(Distribution,
-                                    MAXNAMELEN,
-                                    "%u",
-                                    Index);
-        ASSERT(NT_SUCCESS(status));
+    RtlZeroMemory(Used, sizeof (Used));
 
-        status = XENBUS_STORE(Read,
-                              &Fdo->StoreInterface,
-                              NULL,
-                              "drivers",
-                              Distribution,
-                              &Buffer);
-        if (!NT_SUCCESS(status)) {
-            if (status == STATUS_OBJECT_NAME_NOT_FOUND)
-                goto update;
+    status = XENBUS_STORE(Directory,
+                          &Fdo->StoreInterface,
+                          Transaction,
+                          NULL,
+                          "drivers",
+                          &Buffer);
+    if (NT_SUCCESS(status)) {
+        PCHAR   Name;
 
-            goto fail1;
+        for (Name = Buffer; *Name != '\0'; Name += strlen(Name) + 1) {
+            if (__FdoParseDistribution(Name, &Slot))
+                Used[Slot / 32] |= 1ul << (Slot % 32);
         }
 
         XENBUS_STORE(Free,
                      &Fdo->StoreInterface,
                      Buffer);
+    } else if (status != STATUS_OBJECT_NAME_NOT_FOUND) {
+        goto fail1;
+    }
+
+    // Prefer the slot we held before, so a resume normally lands
+    // straight back where it was
+    if (Fdo->Distribution >= 0) {
+        Slot = Fdo->Distribution;
 
-        Index++;
+        if ((Used[Slot / 32] & (1ul << (Slot % 32))) == 0)
+            goto update;
+    }
+
+    for (Slot = 0; Slot <= MAXIMUM_INDEX; Slot++) {
+        if ((Used[Slot / 32] & (1ul << (Slot % 32))) == 0)
+            goto update;
     }
 
     status = STATUS_UNSUCCESSFUL;
     goto fail2;
 
 update:
+    *Index = Slot;
+
+    status = RtlStringCbPrintfA(Distribution,
+                                MAXNAMELEN,
+                                "%u",
+                                Slot);
+    ASSERT(NT_SUCCESS(status));
+
     status = RtlStringCbPrintfA(Vendor,
                                 MAXNAMELEN,
                                 "%s",
                                 VENDOR_NAME_STR);
     ASSERT(NT_SUCCESS(status));
 
-    for (Index  = 0; Vendor[Index] != '\0'; Index++)
-        if (!isalnum((UCHAR)Vendor[Index]))
-            Vendor[Index] = '_';
+    for (Offset = 0; Vendor[Offset] != '\0'; Offset++)
+        if (!isalnum((UCHAR)Vendor[Offset]))
+            Vendor[Offset] = '_';
 
     Product = "XENCONS";
 
@@ -762,7 +978,7 @@ update:
 
     (VOID) XENBUS_STORE(Printf,
                         &Fdo->StoreInterface,
-                        NULL,
+                        Transaction,
                         "drivers",
                         Distribution,
                         "%s %s %u.%u.%u %s",
@@ -788,43 +1004,449 @@ fail1:
     return status;
 }
 
-static FORCEINLINE VOID
-__FdoD3ToD0(
-    IN  PXENCONS_FDO    Fdo
-    )
-{
-    Trace("====>\n");
+#define MAXIMUM_ATTEMPTS    10
+
+static NTSTATUS
+FdoUpdateDistribution(
+    IN  PXENCONS_FDO            Fdo,
+    IN  BOOLEAN                 Clear,
+    IN  BOOLEAN                 Set
+    )
+{
+    PXENBUS_STORE_TRANSACTION   Transaction;
+    ULONG                       Index;
+    ULONG                       Attempt;
+    ULONG64                     Start;
+    NTSTATUS                    status;
+
+    Trace("====>\n");
+
+    Index = 0;
+    Attempt = 0;
+    for (;;) {
+        status = XENBUS_STORE(TransactionStart,
+                              &Fdo->StoreInterface,
+                              &Transaction);
+        if (!NT_SUCCESS(status))
+            break;
+
+        if (Clear) {
+            Start = __FdoGetTime();
+            FdoClearDistribution(Fdo, Transaction);
+            __FdoTimingPhase(Fdo, XENCONS_PHASE_DISTRIBUTION_CLEAR, Start);
+        }
+
+        if (Set) {
+            Start = __FdoGetTime();
+            status = FdoSetDistribution(Fdo, Transaction, &Index);
+            __FdoTimingPhase(Fdo, XENCONS_PHASE_DISTRIBUTION_SET, Start);
+
+            if (!NT_SUCCESS(status))
+                goto abort;
+        }
+
+        Start = __FdoGetTime();
+        status = XENBUS_STORE(TransactionEnd,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              TRUE);
+        __FdoTimingPhase(Fdo, XENCONS_PHASE_DISTRIBUTION_COMMIT, Start);
+
+        if (status != STATUS_RETRY || ++Attempt > MAXIMUM_ATTEMPTS)
+            break;
+
+        continue;
+
+abort:
+        (VOID) XENBUS_STORE(TransactionEnd,
+                            &Fdo->StoreInterface,
+                            Transaction,
+                            FALSE);
+        break;
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    // Only cache the slot once it has actually been committed
+    if (Set)
+        Fdo->Distribution = (LONG)Index;
+
+    Trace("<====\n");
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+#undef  MAXIMUM_ATTEMPTS
+
+static FORCEINLINE VOID
+__FdoD3ToD0(
+    IN  PXENCONS_FDO    Fdo
+    )
+{
+    Trace("====>\n");
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    // The first time through this also sweeps away stale entries
+    (VOID) FdoUpdateDistribution(Fdo, TRUE, TRUE);
+
+    Trace("<====\n");
+}
+
+static FORCEINLINE VOID
+__FdoD0ToD3(
+    IN  PXENCONS_FDO    Fdo
+    )
+{
+    Trace("====>\n");
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    (VOID) FdoUpdateDistribution(Fdo, TRUE, FALSE);
+
+    Trace("<====\n");
+}
+
+static NTSTATUS
+FdoCreateConsole(
+    IN  PXENCONS_FDO    Fdo,
+    IN  PCHAR           Name,
+    IN  PFDO_CONSOLE    Console
+    )
+{
+    ANSI_STRING         Ansi;
+    NTSTATUS            status;
+
+    RtlInitAnsiString(&Ansi, Name);
+
+    status = RtlAnsiStringToUnicodeString(&Console->Name, &Ansi, TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = IoRegisterDeviceInterface(__FdoGetPhysicalDeviceObject(Fdo),
+                                       &GUID_XENCONS_DEVICE,
+                                       &Console->Name,
+                                       &Console->Link);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = FrontendCreate(Fdo, Name, &Console->Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    status = ConsoleCreate(Fdo, Console->Frontend, &Console->Console);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    Info("%s\n", FrontendGetPath(Console->Frontend));
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+    FrontendDestroy(Console->Frontend);
+    Console->Frontend = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    RtlFreeUnicodeString(&Console->Link);
+    RtlZeroMemory(&Console->Link, sizeof (UNICODE_STRING));
+
+fail2:
+    Error("fail2\n");
+
+    RtlFreeUnicodeString(&Console->Name);
+    RtlZeroMemory(&Console->Name, sizeof (UNICODE_STRING));
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+FdoDestroyConsole(
+    IN  PXENCONS_FDO    Fdo,
+    IN  PFDO_CONSOLE    Console
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    ASSERT(!Console->Enabled);
+
+    ConsoleDestroy(Console->Console);
+    Console->Console = NULL;
+
+    FrontendDestroy(Console->Frontend);
+    Console->Frontend = NULL;
+
+    RtlFreeUnicodeString(&Console->Link);
+    RtlZeroMemory(&Console->Link, sizeof (UNICODE_STRING));
+
+    RtlFreeUnicodeString(&Console->Name);
+    RtlZeroMemory(&Console->Name, sizeof (UNICODE_STRING));
+
+    ASSERT(IsZeroMemory(Console, sizeof (FDO_CONSOLE)));
+}
+
+// Consoles other than the primary are listed under device/console. Each
+// one found when the device starts gets a frontend to connect its ring,
+// a console of its own (so its own worker thread, buffers and counters)
+// and its own instance of the device interface, with the node name as
+// the reference string.
+static VOID
+FdoCreateConsoles(
+    IN  PXENCONS_FDO    Fdo
+    )
+{
+    PCHAR               Buffer;
+    PCHAR               Name;
+    NTSTATUS            status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+    ASSERT3U(Fdo->SecondaryCount, ==, 0);
+
+    // Older versions of XENBUS may not provide these
+    if (Fdo->EvtchnInterface.Interface.Context == NULL ||
+        Fdo->GnttabInterface.Interface.Context == NULL)
+        return;
+
+    status = XENBUS_STORE(Acquire, &Fdo->StoreInterface);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = XENBUS_STORE(Directory,
+                          &Fdo->StoreInterface,
+                          NULL,
+                          "device",
+                          "console",
+                          &Buffer);
+    if (!NT_SUCCESS(status))
+        goto done;
+
+    for (Name = Buffer; *Name != '\0'; Name += strlen(Name) + 1) {
+        // If this is present then it is the primary console
+        if (strcmp(Name, "0") == 0)
+            continue;
+
+        if (Fdo->SecondaryCount == FDO_MAXIMUM_CONSOLES) {
+            Warning("device/console/%s: too many consoles\n", Name);
+            continue;
+        }
+
+        status = FdoCreateConsole(Fdo,
+                                  Name,
+                                  &Fdo->Secondary[Fdo->SecondaryCount]);
+        if (NT_SUCCESS(status))
+            Fdo->SecondaryCount++;
+    }
+
+    XENBUS_STORE(Free,
+                 &Fdo->StoreInterface,
+                 Buffer);
+
+done:
+    XENBUS_STORE(Release, &Fdo->StoreInterface);
+
+    return;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+}
+
+static VOID
+FdoDestroyConsoles(
+    IN  PXENCONS_FDO    Fdo
+    )
+{
+    while (Fdo->SecondaryCount != 0)
+        FdoDestroyConsole(Fdo, &Fdo->Secondary[--Fdo->SecondaryCount]);
+}
+
+// A secondary console that cannot be connected does not stop the device
+// starting. It is left disabled, and its handles wait just as they do
+// across a power transition.
+static VOID
+FdoEnableConsoles(
+    IN  PXENCONS_FDO    Fdo
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < Fdo->SecondaryCount; Index++) {
+        PFDO_CONSOLE    Console = &Fdo->Secondary[Index];
+        NTSTATUS        status;
+
+        status = ConsoleEnable(Console->Console);
+        if (!NT_SUCCESS(status)) {
+            Warning("%s: not enabled (%08x)\n",
+                    FrontendGetPath(Console->Frontend),
+                    status);
+            continue;
+        }
+
+        Console->Enabled = TRUE;
+    }
+}
+
+static VOID
+FdoDisableConsoles(
+    IN  PXENCONS_FDO    Fdo
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < Fdo->SecondaryCount; Index++) {
+        PFDO_CONSOLE    Console = &Fdo->Secondary[Index];
+
+        if (!Console->Enabled)
+            continue;
+
+        ConsoleDisable(Console->Console);
+        Console->Enabled = FALSE;
+    }
+}
+
+// The primary console is opened with no reference string. Anything else
+// must name a secondary console.
+static PXENCONS_CONSOLE
+FdoLookupConsole(
+    IN  PXENCONS_FDO    Fdo,
+    IN  PUNICODE_STRING FileName
+    )
+{
+    UNICODE_STRING      Name;
+    ULONG               Index;
+
+    if (FileName->Length == 0)
+        return Fdo->Console;
+
+    Name = *FileName;
+
+    if (Name.Buffer[0] == L'\\') {
+        Name.Buffer++;
+        Name.Length -= sizeof (WCHAR);
+        Name.MaximumLength -= sizeof (WCHAR);
+    }
+
+    for (Index = 0; Index < Fdo->SecondaryCount; Index++) {
+        PFDO_CONSOLE    Console = &Fdo->Secondary[Index];
+
+        if (RtlEqualUnicodeString(&Name, &Console->Name, FALSE))
+            return Console->Console;
+    }
+
+    return NULL;
+}
+
+// Nothing in the data path depends on the distribution entry, so after
+// resume it is updated from a thread rather than holding up the console
+static DECLSPEC_NOINLINE VOID
+FdoSuspendCallbackLate(
+    IN  PVOID       Argument
+    )
+{
+    PXENCONS_FDO    Fdo = Argument;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    Fdo->DistributionTime = __FdoGetTime();
+    KeMemoryBarrier();
+
+    InterlockedIncrement(&Fdo->DistributionRequested);
+    ThreadWake(Fdo->DistributionThread);
+}
+
+#define FDO_DISTRIBUTION_RETRY_PERIOD   1000    // ms
+#define FDO_DISTRIBUTION_RETRIES        10
+
+static NTSTATUS
+FdoDistribution(
+    IN  PXENCONS_THREAD Self,
+    IN  PVOID           Context
+    )
+{
+    PXENCONS_FDO        Fdo = Context;
+    PKEVENT             Event;
+    LARGE_INTEGER       Timeout;
+    PLARGE_INTEGER      Wait;
+    ULONG               Attempt;
+
+    Trace("====>\n");
+
+    Event = ThreadGetEvent(Self);
+
+    Wait = NULL;
+    Attempt = 0;
+
+    for (;;) {
+        LONG        Requested;
+        NTSTATUS    status;
+
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     Wait);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        // Serialize with FdoD0ToD3, which releases the store interface
+        // and discards any update still outstanding
+        ExAcquireFastMutex(&Fdo->Mutex);
+
+        Requested = Fdo->DistributionRequested;
+        KeMemoryBarrier();
+
+        if (Requested == Fdo->DistributionCompleted) {
+            ExReleaseFastMutex(&Fdo->Mutex);
+
+            Wait = NULL;
+            Attempt = 0;
+            continue;
+        }
+
+        __FdoTimingStart(Fdo, XENCONS_TRANSITION_RESUME);
+
+        if (Attempt == 0)
+            __FdoTimingPhase(Fdo,
+                             XENCONS_PHASE_DEFERRAL,
+                             Fdo->DistributionTime);
 
-    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+        // Replace the entry in a single transaction so the toolstack
+        // never sees it missing
+        status = FdoUpdateDistribution(Fdo, TRUE, TRUE);
 
-    (VOID) FdoSetDistribution(Fdo);
+        FdoTimingEnd(Fdo);
 
-    Trace("<====\n");
-}
+        if (NT_SUCCESS(status) || ++Attempt > FDO_DISTRIBUTION_RETRIES) {
+            if (!NT_SUCCESS(status))
+                Warning("giving up (%08x)\n", status);
 
-static FORCEINLINE VOID
-__FdoD0ToD3(
-    IN  PXENCONS_FDO    Fdo
-    )
-{
-    Trace("====>\n");
+            Fdo->DistributionCompleted = Requested;
 
-    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+            Wait = NULL;
+            Attempt = 0;
+        } else {
+            Timeout.QuadPart = -10000ll * FDO_DISTRIBUTION_RETRY_PERIOD;
+            Wait = &Timeout;
+        }
 
-    FdoClearDistribution(Fdo);
+        ExReleaseFastMutex(&Fdo->Mutex);
+    }
 
     Trace("<====\n");
-}
-
-static DECLSPEC_NOINLINE VOID
-FdoSuspendCallbackLate(
-    IN  PVOID       Argument
-    )
-{
-    PXENCONS_FDO    Fdo = Argument;
 
-    __FdoD0ToD3(Fdo);
-    __FdoD3ToD0(Fdo);
+    return STATUS_SUCCESS;
 }
 
 // This function must not touch pageable code or data
@@ -836,6 +1458,8 @@ FdoD3ToD0(
     PXENCONS_DX         Dx = Fdo->Dx;
     POWER_STATE         PowerState;
     KIRQL               Irql;
+    ULONG64             Start;
+    ULONG               Index;
     NTSTATUS            status;
 
     ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
@@ -843,18 +1467,48 @@ FdoD3ToD0(
 
     Trace("====>\n");
 
+    ExAcquireFastMutex(&Fdo->Mutex);
+
+    __FdoTimingStart(Fdo, XENCONS_TRANSITION_D3_TO_D0);
+
+    Start = __FdoGetTime();
+    status = ConsoleEnable(Fdo->Console);
+    __FdoTimingPhase(Fdo, XENCONS_PHASE_CONSOLE_ENABLE, Start);
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
+    Start = __FdoGetTime();
+
+    status = XENBUS_DEBUG(Acquire, &Fdo->DebugInterface);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_DEBUG(Register,
+                          &Fdo->DebugInterface,
+                          __MODULE__ "|FDO",
+                          FdoDebugCallback,
+                          Fdo,
+                          &Fdo->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
     status = XENBUS_SUSPEND(Acquire, &Fdo->SuspendInterface);
     if (!NT_SUCCESS(status))
-        goto fail1;
+        goto fail4;
 
     status = XENBUS_STORE(Acquire, &Fdo->StoreInterface);
     if (!NT_SUCCESS(status))
-        goto fail2;
+        goto fail5;
+
+    __FdoTimingPhase(Fdo, XENCONS_PHASE_INTERFACE_ACQUIRE, Start);
 
     __FdoD3ToD0(Fdo);
 
+    Start = __FdoGetTime();
+
     status = XENBUS_SUSPEND(Register,
                             &Fdo->SuspendInterface,
                             SUSPEND_CALLBACK_LATE,
@@ -862,10 +1516,21 @@ FdoD3ToD0(
                             Fdo,
                             &Fdo->SuspendCallbackLate);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail6;
+
+    __FdoTimingPhase(Fdo, XENCONS_PHASE_INTERFACE_ACQUIRE, Start);
 
     KeLowerIrql(Irql);
 
+    FdoTimingEnd(Fdo);
+
+    ExReleaseFastMutex(&Fdo->Mutex);
+
+    // Connecting a secondary console waits on xenstore, and the mutex
+    // only guards state shared with the distribution thread, so this
+    // is done without it
+    FdoEnableConsoles(Fdo);
+
     __FdoSetDevicePowerState(Fdo, PowerDeviceD0);
 
     PowerState.DeviceState = PowerDeviceD0;
@@ -876,28 +1541,55 @@ FdoD3ToD0(
 #pragma prefast(suppress:28123)
     (VOID) IoSetDeviceInterfaceState(&Dx->Link, TRUE);
 
+    for (Index = 0; Index < Fdo->SecondaryCount; Index++) {
+        PFDO_CONSOLE    Console = &Fdo->Secondary[Index];
+
+        if (Console->Enabled)
+            (VOID) IoSetDeviceInterfaceState(&Console->Link, TRUE);
+    }
+
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
-fail3:
-    Error("fail4\n");
+fail6:
+    Error("fail6\n");
 
     __FdoD0ToD3(Fdo);
 
     XENBUS_STORE(Release, &Fdo->StoreInterface);
 
-fail2:
-    Error("fail2\n");
+fail5:
+    Error("fail5\n");
 
     XENBUS_SUSPEND(Release, &Fdo->SuspendInterface);
 
     __FdoD0ToD3(Fdo);
 
+fail4:
+    Error("fail4\n");
+
+    XENBUS_DEBUG(Deregister,
+                 &Fdo->DebugInterface,
+                 Fdo->DebugCallback);
+    Fdo->DebugCallback = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    XENBUS_DEBUG(Release, &Fdo->DebugInterface);
+
+fail2:
+    Error("fail2\n");
+
+    KeLowerIrql(Irql);
+
+    ConsoleDisable(Fdo->Console);
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
-    KeLowerIrql(Irql);
+    ExReleaseFastMutex(&Fdo->Mutex);
 
     return status;
 }
@@ -923,6 +1615,27 @@ __FdoDestroyHandle(
     __FdoFree(Handle);
 }
 
+// The FDO_HANDLE is attached to the file object's context for the
+// lifetime of the handle so the read/write path need not search for it.
+// Whichever of FdoDispatchCleanup or FdoDestroyAllHandles manages to
+// detach it from the file object owns its destruction.
+static FORCEINLINE PFDO_HANDLE
+__FdoGetHandle(
+    IN  PFILE_OBJECT    FileObject
+    )
+{
+    return (PFDO_HANDLE)FileObject->FsContext;
+}
+
+static FORCEINLINE PFDO_HANDLE
+__FdoDetachHandle(
+    IN  PFILE_OBJECT    FileObject
+    )
+{
+    return (PFDO_HANDLE)InterlockedExchangePointer(&FileObject->FsContext,
+                                                   NULL);
+}
+
 static VOID
 FdoDestroyHandle(
     IN  PXENCONS_FDO    Fdo,
@@ -946,17 +1659,29 @@ FdoDestroyAllHandles(
     KIRQL               Irql;
     LIST_ENTRY          List;
     PLIST_ENTRY         ListEntry;
+    PLIST_ENTRY         Next;
     PFDO_HANDLE         Handle;
 
     InitializeListHead(&List);
 
     KeAcquireSpinLock(&Fdo->HandleLock, &Irql);
 
-    ListEntry = Fdo->HandleList.Flink;
-    if (!IsListEmpty(&Fdo->HandleList)) {
-        RemoveEntryList(&Fdo->HandleList);
-        InitializeListHead(&Fdo->HandleList);
-        AppendTailList(&List, ListEntry);
+    for (ListEntry = Fdo->HandleList.Flink;
+         ListEntry != &Fdo->HandleList;
+         ListEntry = Next) {
+        Next = ListEntry->Flink;
+
+        Handle = CONTAINING_RECORD(ListEntry,
+                                   FDO_HANDLE,
+                                   ListEntry);
+
+        // If cleanup has already detached the handle then it is about
+        // to remove it from the list itself.
+        if (__FdoDetachHandle(Handle->FileObject) == NULL)
+            continue;
+
+        RemoveEntryList(&Handle->ListEntry);
+        InsertTailList(&List, &Handle->ListEntry);
     }
 
     KeReleaseSpinLock(&Fdo->HandleLock, Irql);
@@ -973,26 +1698,50 @@ FdoDestroyAllHandles(
     }
 }
 
+// Handles survive power transitions but not the device being stopped or
+// removed.
+static VOID
+FdoDisableInterface(
+    IN  PXENCONS_FDO    Fdo
+    )
+{
+    PXENCONS_DX         Dx = Fdo->Dx;
+    ULONG               Index;
+
+#pragma prefast(suppress:28123)
+    (VOID) IoSetDeviceInterfaceState(&Dx->Link, FALSE);
+
+    for (Index = 0; Index < Fdo->SecondaryCount; Index++)
+        (VOID) IoSetDeviceInterfaceState(&Fdo->Secondary[Index].Link, FALSE);
+
+    FdoDestroyAllHandles(Fdo);
+}
+
 // This function must not touch pageable code or data
 static DECLSPEC_NOINLINE VOID
 FdoD0ToD3(
     IN  PXENCONS_FDO    Fdo
     )
 {
-    PXENCONS_DX         Dx = Fdo->Dx;
     POWER_STATE         PowerState;
     KIRQL               Irql;
+    ULONG64             Start;
 
     ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
     ASSERT3U(__FdoGetDevicePowerState(Fdo), ==, PowerDeviceD0);
 
     Trace("====>\n");
 
-#pragma prefast(suppress:28123)
-    (VOID) IoSetDeviceInterfaceState(&Dx->Link, FALSE);
+    // Closing a secondary console can wait for its backend, so this is
+    // done before taking the mutex (see FdoD3ToD0)
+    FdoDisableConsoles(Fdo);
 
-    FdoDestroyAllHandles(Fdo);
+    ExAcquireFastMutex(&Fdo->Mutex);
+
+    __FdoTimingStart(Fdo, XENCONS_TRANSITION_D0_TO_D3);
 
+    // Open handles are kept. Their queued IRPs and buffered data are
+    // simply held until the console is enabled again.
     PowerState.DeviceState = PowerDeviceD3;
     PoSetPowerState(Fdo->Dx->DeviceObject,
                     DevicePowerState,
@@ -1002,19 +1751,48 @@ FdoD0ToD3(
 
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
+    Start = __FdoGetTime();
+
     XENBUS_SUSPEND(Deregister,
                    &Fdo->SuspendInterface,
                    Fdo->SuspendCallbackLate);
     Fdo->SuspendCallbackLate = NULL;
 
+    __FdoTimingPhase(Fdo, XENCONS_PHASE_INTERFACE_RELEASE, Start);
+
+    // Any deferred update is superseded by clearing the entry. Wake the
+    // thread so that it also abandons any retry it is waiting on; it
+    // cannot get the mutex until this transition is done.
+    Fdo->DistributionCompleted = Fdo->DistributionRequested;
+    ThreadWake(Fdo->DistributionThread);
+
     __FdoD0ToD3(Fdo);
 
+    Start = __FdoGetTime();
+
     XENBUS_STORE(Release, &Fdo->StoreInterface);
 
     XENBUS_SUSPEND(Release, &Fdo->SuspendInterface);
 
+    XENBUS_DEBUG(Deregister,
+                 &Fdo->DebugInterface,
+                 Fdo->DebugCallback);
+    Fdo->DebugCallback = NULL;
+
+    XENBUS_DEBUG(Release, &Fdo->DebugInterface);
+
+    __FdoTimingPhase(Fdo, XENCONS_PHASE_INTERFACE_RELEASE, Start);
+
     KeLowerIrql(Irql);
 
+    Start = __FdoGetTime();
+    ConsoleDisable(Fdo->Console);
+    __FdoTimingPhase(Fdo, XENCONS_PHASE_CONSOLE_DISABLE, Start);
+
+    FdoTimingEnd(Fdo);
+
+    ExReleaseFastMutex(&Fdo->Mutex);
+
     Trace("<====\n");
 }
 
@@ -1061,6 +1839,8 @@ FdoStartDevice(
                       StackLocation->Parameters.StartDevice.AllocatedResources,
                       StackLocation->Parameters.StartDevice.AllocatedResourcesTranslated);
 
+    FdoCreateConsoles(Fdo);
+
     status = FdoD3ToD0(Fdo);
     if (!NT_SUCCESS(status))
         goto fail2;
@@ -1075,6 +1855,8 @@ FdoStartDevice(
 fail2:
     Error("fail2\n");
 
+    FdoDestroyConsoles(Fdo);
+
     RtlZeroMemory(&Fdo->Resource, sizeof (FDO_RESOURCE) * RESOURCE_COUNT);
 
 fail1:
@@ -1129,9 +1911,13 @@ FdoStopDevice(
 {
     NTSTATUS            status;
 
+    FdoDisableInterface(Fdo);
+
     if (__FdoGetDevicePowerState(Fdo) == PowerDeviceD0)
         FdoD0ToD3(Fdo);
 
+    FdoDestroyConsoles(Fdo);
+
     RtlZeroMemory(&Fdo->Resource, sizeof (FDO_RESOURCE) * RESOURCE_COUNT);
 
     __FdoSetDevicePnpState(Fdo, Stopped);
@@ -1209,9 +1995,13 @@ FdoRemoveDevice(
     if (__FdoGetPreviousDevicePnpState(Fdo) != Started)
         goto done;
 
+    FdoDisableInterface(Fdo);
+
     if (__FdoGetDevicePowerState(Fdo) == PowerDeviceD0)
         FdoD0ToD3(Fdo);
 
+    FdoDestroyConsoles(Fdo);
+
     RtlZeroMemory(&Fdo->Resource, sizeof (FDO_RESOURCE) * RESOURCE_COUNT);
 
 done:
@@ -2172,80 +2962,51 @@ FdoCreateHandle(
     IN  PFILE_OBJECT    FileObject
     )
 {
+    PXENCONS_CONSOLE    Console;
     PFDO_HANDLE         Handle;
     KIRQL               Irql;
     NTSTATUS            status;
 
+    Console = FdoLookupConsole(Fdo, &FileObject->FileName);
+
+    status = STATUS_OBJECT_NAME_NOT_FOUND;
+    if (Console == NULL)
+        goto fail1;
+
     Handle = __FdoAllocate(sizeof (FDO_HANDLE));
 
     status = STATUS_NO_MEMORY;
     if (Handle == NULL)
-        goto fail1;
+        goto fail2;
 
-    status = StreamCreate(Fdo, &Handle->Stream);
+    status = StreamCreate(Fdo, Console, FileObject, &Handle->Stream);
     if (!NT_SUCCESS(status))
-        goto fail2;
+        goto fail3;
 
     Handle->FileObject = FileObject;
 
     KeAcquireSpinLock(&Fdo->HandleLock, &Irql);
     InsertTailList(&Fdo->HandleList, &Handle->ListEntry);
+    FileObject->FsContext = Handle;
     KeReleaseSpinLock(&Fdo->HandleLock, Irql);
 
     Trace("%p\n", Handle->FileObject);
 
     return STATUS_SUCCESS;
 
-fail2:
-    Error("fail2\n");
+fail3:
+    Error("fail3\n");
 
     ASSERT(IsZeroMemory(Handle, sizeof (FDO_HANDLE)));
     __FdoFree(Handle);
 
-fail1:
-    Error("fail1 (%08x)\n", status);
-
-    return status;
-}
-
-static PFDO_HANDLE
-FdoFindHandle(
-    IN  PXENCONS_FDO    Fdo,
-    IN  PFILE_OBJECT    FileObject
-    )
-{
-    KIRQL               Irql;
-    PLIST_ENTRY         ListEntry;
-    PFDO_HANDLE         Handle;
-    NTSTATUS            status;
-
-    KeAcquireSpinLock(&Fdo->HandleLock, &Irql);
-
-    for (ListEntry = Fdo->HandleList.Flink;
-         ListEntry != &Fdo->HandleList;
-         ListEntry = ListEntry->Flink) {
-        Handle = CONTAINING_RECORD(ListEntry,
-                                   FDO_HANDLE,
-                                   ListEntry);
-
-        if (Handle->FileObject == FileObject)
-            goto found;
-    }
-
-    status = STATUS_UNSUCCESSFUL;
-    goto fail1;
-
-found:
-    KeReleaseSpinLock(&Fdo->HandleLock, Irql);
-
-    return Handle;
+fail2:
+    Error("fail2\n");
 
 fail1:
     Error("fail1 (%08x)\n", status);
 
-    KeReleaseSpinLock(&Fdo->HandleLock, Irql);
-
-    return NULL;
+    return status;
 }
 
 static DECLSPEC_NOINLINE NTSTATUS
@@ -2279,7 +3040,7 @@ FdoDispatchCleanup(
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
 
-    Handle = FdoFindHandle(Fdo, StackLocation->FileObject);
+    Handle = __FdoDetachHandle(StackLocation->FileObject);
 
     status = STATUS_UNSUCCESSFUL;
     if (Handle == NULL)
@@ -2321,7 +3082,7 @@ FdoDispatchClose(
 }
 
 static DECLSPEC_NOINLINE NTSTATUS
-FdoDispatchReadWrite(
+FdoDispatchStream(
     IN  PXENCONS_FDO    Fdo,
     IN  PIRP            Irp
     )
@@ -2330,24 +3091,17 @@ FdoDispatchReadWrite(
     PFDO_HANDLE         Handle;
     NTSTATUS            status;
 
+    UNREFERENCED_PARAMETER(Fdo);
+
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
 
-    Handle = FdoFindHandle(Fdo, StackLocation->FileObject);
+    Handle = __FdoGetHandle(StackLocation->FileObject);
 
     status = STATUS_UNSUCCESSFUL;
     if (Handle == NULL)
         goto fail1;
 
-    IoMarkIrpPending(Irp);
-
-    status = StreamPutQueue(Handle->Stream, Irp);
-    if (!NT_SUCCESS(status))
-        goto fail2;
-
-    return STATUS_PENDING;
-
-fail2:
-    Error("fail2\n");
+    return StreamDispatch(Handle->Stream, Irp);
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -2380,14 +3134,12 @@ FdoDispatch(
 {
     PIO_STACK_LOCATION  StackLocation;
     UCHAR               MajorFunction;
+    UCHAR               MinorFunction;
     NTSTATUS            status;
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
     MajorFunction = StackLocation->MajorFunction;
-
-    Trace("====> (%02x:%s)\n",
-          MajorFunction,
-          MajorFunctionName(MajorFunction));
+    MinorFunction = StackLocation->MinorFunction;
 
     switch (MajorFunction) {
     case IRP_MJ_PNP:
@@ -2412,7 +3164,9 @@ FdoDispatch(
 
     case IRP_MJ_READ:
     case IRP_MJ_WRITE:
-        status = FdoDispatchReadWrite(Fdo, Irp);
+    case IRP_MJ_FLUSH_BUFFERS:
+    case IRP_MJ_DEVICE_CONTROL:
+        status = FdoDispatchStream(Fdo, Irp);
         break;
 
     default:
@@ -2420,10 +3174,9 @@ FdoDispatch(
         break;
     }
 
-    Trace("<==== (%02x:%s)(%08x)\n",
-          MajorFunction,
-          MajorFunctionName(MajorFunction),
-          status);
+    // The stack location cannot be touched once the IRP has been passed
+    // on, so the values were captured above.
+    TraceEvent(XENCONS_TRACE_DISPATCH, MajorFunction, MinorFunction, status);
 
     return status;
 }
@@ -2529,6 +3282,8 @@ DEFINE_FDO_GET_INTERFACE(Debug, PXENBUS_DEBUG_INTERFACE)
 DEFINE_FDO_GET_INTERFACE(Suspend, PXENBUS_SUSPEND_INTERFACE)
 DEFINE_FDO_GET_INTERFACE(Store, PXENBUS_STORE_INTERFACE)
 DEFINE_FDO_GET_INTERFACE(Console, PXENBUS_CONSOLE_INTERFACE)
+DEFINE_FDO_GET_INTERFACE(Evtchn, PXENBUS_EVTCHN_INTERFACE)
+DEFINE_FDO_GET_INTERFACE(Gnttab, PXENBUS_GNTTAB_INTERFACE)
 
 #pragma warning(push)
 #pragma warning(disable:6014) // Leaking memory '&Dx->Link'
@@ -2590,16 +3345,20 @@ FdoCreate(
     if (!NT_SUCCESS(status))
         goto fail5;
 
-    status = __FdoAcquireLowerBusInterface(Fdo);
+    status = ThreadCreate(FdoDistribution, Fdo, &Fdo->DistributionThread);
     if (!NT_SUCCESS(status))
         goto fail6;
 
+    status = __FdoAcquireLowerBusInterface(Fdo);
+    if (!NT_SUCCESS(status))
+        goto fail7;
+
     if (FdoGetBusData(Fdo,
                       PCI_WHICHSPACE_CONFIG,
                       &DeviceID,
                       FIELD_OFFSET(PCI_COMMON_HEADER, DeviceID),
                       FIELD_SIZE(PCI_COMMON_HEADER, DeviceID)) == 0)
-        goto fail7;
+        goto fail8;
 
     __FdoSetVendorName(Fdo, DeviceID);
 
@@ -2612,7 +3371,7 @@ FdoCreate(
                                  sizeof (Fdo->DebugInterface),
                                  FALSE);
     if (!NT_SUCCESS(status))
-        goto fail8;
+        goto fail9;
 
     status = FDO_QUERY_INTERFACE(Fdo,
                                  XENBUS,
@@ -2621,7 +3380,7 @@ FdoCreate(
                                  sizeof (Fdo->SuspendInterface),
                                  FALSE);
     if (!NT_SUCCESS(status))
-        goto fail9;
+        goto fail10;
 
     status = FDO_QUERY_INTERFACE(Fdo,
                                  XENBUS,
@@ -2630,7 +3389,7 @@ FdoCreate(
                                  sizeof (Fdo->StoreInterface),
                                  FALSE);
     if (!NT_SUCCESS(status))
-        goto fail10;
+        goto fail11;
 
     status = FDO_QUERY_INTERFACE(Fdo,
                                  XENBUS,
@@ -2639,12 +3398,41 @@ FdoCreate(
                                  sizeof (Fdo->ConsoleInterface),
                                  FALSE);
     if (!NT_SUCCESS(status))
-        goto fail11;
+        goto fail12;
+
+    // These are only needed for secondary consoles
+    status = FDO_QUERY_INTERFACE(Fdo,
+                                 XENBUS,
+                                 EVTCHN,
+                                 (PINTERFACE)&Fdo->EvtchnInterface,
+                                 sizeof (Fdo->EvtchnInterface),
+                                 TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail13;
+
+    status = FDO_QUERY_INTERFACE(Fdo,
+                                 XENBUS,
+                                 GNTTAB,
+                                 (PINTERFACE)&Fdo->GnttabInterface,
+                                 sizeof (Fdo->GnttabInterface),
+                                 TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail14;
+
+    status = ConsoleCreate(Fdo, NULL, &Fdo->Console);
+    if (!NT_SUCCESS(status))
+        goto fail15;
 
     InitializeListHead(&Fdo->HandleList);
     KeInitializeSpinLock(&Fdo->HandleLock);
 
-    FunctionDeviceObject->Flags |= DO_BUFFERED_IO;
+    Fdo->Distribution = -1;
+
+    ExInitializeFastMutex(&Fdo->Mutex);
+
+    KeInitializeSpinLock(&Fdo->TimingLock);
+
+    FunctionDeviceObject->Flags |= DO_DIRECT_IO;
 
     Dx->Fdo = Fdo;
 
@@ -2655,33 +3443,55 @@ FdoCreate(
     FunctionDeviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
     return STATUS_SUCCESS;
 
-fail11:
-    Error("fail11\n");
+fail15:
+    Error("fail15\n");
+
+    RtlZeroMemory(&Fdo->GnttabInterface,
+                  sizeof (XENBUS_GNTTAB_INTERFACE));
+
+fail14:
+    Error("fail14\n");
+
+    RtlZeroMemory(&Fdo->EvtchnInterface,
+                  sizeof (XENBUS_EVTCHN_INTERFACE));
+
+fail13:
+    Error("fail13\n");
+
+fail12:
+    Error("fail12\n");
 
     RtlZeroMemory(&Fdo->ConsoleInterface,
                   sizeof (XENBUS_CONSOLE_INTERFACE));
 
-fail10:
-    Error("fail10\n");
+fail11:
+    Error("fail11\n");
 
     RtlZeroMemory(&Fdo->SuspendInterface,
                   sizeof (XENBUS_SUSPEND_INTERFACE));
 
-fail9:
-    Error("fail9\n");
+fail10:
+    Error("fail10\n");
 
     RtlZeroMemory(&Fdo->DebugInterface,
                   sizeof (XENBUS_DEBUG_INTERFACE));
 
+fail9:
+    Error("fail9\n");
+
+    RtlZeroMemory(Fdo->VendorName, MAXNAMELEN);
+
 fail8:
     Error("fail8\n");
 
-    RtlZeroMemory(Fdo->VendorName, MAXNAMELEN);
+    __FdoReleaseLowerBusInterface(Fdo);
 
 fail7:
     Error("fail7\n");
 
-    __FdoReleaseLowerBusInterface(Fdo);
+    ThreadAlert(Fdo->DistributionThread);
+    ThreadJoin(Fdo->DistributionThread);
+    Fdo->DistributionThread = NULL;
 
 fail6:
     Error("fail6\n");
@@ -2744,11 +3554,41 @@ FdoDestroy(
 
     Dx->Fdo = NULL;
 
+    // The thread takes the mutex whenever it wakes, so it must be gone
+    // before the mutex is
+    ThreadAlert(Fdo->DistributionThread);
+    ThreadJoin(Fdo->DistributionThread);
+    Fdo->DistributionThread = NULL;
+
+    Fdo->Distribution = 0;
+
+    RtlZeroMemory(&Fdo->Mutex, sizeof (FAST_MUTEX));
+
+    Fdo->DistributionRequested = 0;
+    Fdo->DistributionCompleted = 0;
+    Fdo->DistributionTime = 0;
+
+    RtlZeroMemory(&Fdo->TimingLock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(Fdo->Timing, sizeof (Fdo->Timing));
+    Fdo->TimingCount = 0;
+
+    RtlZeroMemory(&Fdo->Sample, sizeof (XENCONS_RESUME_SAMPLE));
+    Fdo->SampleStart = 0;
+
     RtlZeroMemory(&Fdo->HandleLock, sizeof (KSPIN_LOCK));
 
     ASSERT(IsListEmpty(&Fdo->HandleList));
     RtlZeroMemory(&Fdo->HandleList, sizeof (LIST_ENTRY));
 
+    ConsoleDestroy(Fdo->Console);
+    Fdo->Console = NULL;
+
+    RtlZeroMemory(&Fdo->GnttabInterface,
+                  sizeof (XENBUS_GNTTAB_INTERFACE));
+
+    RtlZeroMemory(&Fdo->EvtchnInterface,
+                  sizeof (XENBUS_EVTCHN_INTERFACE));
+
     RtlZeroMemory(&Fdo->ConsoleInterface,
                   sizeof (XENBUS_CONSOLE_INTERFACE));
 
@@ -37,8 +37,11 @@
 #include <suspend_interface.h>
 #include <store_interface.h>
 #include <console_interface.h>
+#include <evtchn_interface.h>
+#include <gnttab_interface.h>
 
 #include "driver.h"
+#include "console.h"
 
 extern NTSTATUS
 FdoDispatch(
@@ -57,6 +60,14 @@ DECLARE_FDO_GET_INTERFACE(Debug, PXENBUS_DEBUG_INTERFACE)
 DECLARE_FDO_GET_INTERFACE(Suspend, PXENBUS_SUSPEND_INTERFACE)
 DECLARE_FDO_GET_INTERFACE(Store, PXENBUS_STORE_INTERFACE)
 DECLARE_FDO_GET_INTERFACE(Console, PXENBUS_CONSOLE_INTERFACE)
+DECLARE_FDO_GET_INTERFACE(Evtchn, PXENBUS_EVTCHN_INTERFACE)
+DECLARE_FDO_GET_INTERFACE(Gnttab, PXENBUS_GNTTAB_INTERFACE)
+
+extern NTSTATUS
+FdoQueryResumeTiming(
+    IN  PXENCONS_FDO    Fdo,
+    IN  PIRP            Irp
+    );
 
 extern NTSTATUS
 FdoCreate(
@@ -0,0 +1,901 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <ntstrsafe.h>
+#include <stdlib.h>
+#include <store_interface.h>
+#include <suspend_interface.h>
+#include <evtchn_interface.h>
+#include <gnttab_interface.h>
+
+#include "fdo.h"
+#include "frontend.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+#define FRONTEND_POOL 'TNRF'
+
+#define MAXNAMELEN  128
+
+// The page shared with the backend. This must match struct
+// xencons_interface in xen/include/public/io/console.h: In carries data
+// from the backend and Out carries data to it.
+#define FRONTEND_IN_SIZE    1024
+#define FRONTEND_OUT_SIZE   2048
+
+typedef struct _FRONTEND_SHARED {
+    CHAR            In[FRONTEND_IN_SIZE];
+    CHAR            Out[FRONTEND_OUT_SIZE];
+    volatile ULONG  InConsumer;
+    volatile ULONG  InProducer;
+    volatile ULONG  OutConsumer;
+    volatile ULONG  OutProducer;
+} FRONTEND_SHARED, *PFRONTEND_SHARED;
+
+// Values of XenbusState (xen/include/public/io/xenbus.h)
+#define FRONTEND_STATE_CONNECTED    4
+#define FRONTEND_STATE_CLOSING      5
+#define FRONTEND_STATE_CLOSED       6
+
+#define FRONTEND_MAXIMUM_ATTEMPTS   10
+
+#define FRONTEND_CLOSE_TIMEOUT      1000    // ms
+
+struct _XENCONS_FRONTEND {
+    PXENCONS_FDO                Fdo;
+    CHAR                        Path[MAXNAMELEN];
+    PCHAR                       BackendPath;
+    USHORT                      BackendDomain;
+    PMDL                        Mdl;
+    PFRONTEND_SHARED            Shared;
+    KSPIN_LOCK                  Lock;
+    PKEVENT                     Event;
+    KDPC                        Dpc;
+    BOOLEAN                     Connected;
+    XENBUS_STORE_INTERFACE      StoreInterface;
+    XENBUS_SUSPEND_INTERFACE    SuspendInterface;
+    XENBUS_EVTCHN_INTERFACE     EvtchnInterface;
+    XENBUS_GNTTAB_INTERFACE     GnttabInterface;
+    PXENBUS_GNTTAB_CACHE        GnttabCache;
+    PXENBUS_GNTTAB_ENTRY        Entry;
+    PXENBUS_EVTCHN_CHANNEL      Channel;
+    PXENBUS_SUSPEND_CALLBACK    SuspendCallbackLate;
+};
+
+static FORCEINLINE PVOID
+__FrontendAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocatePoolWithTag(NonPagedPool, Length, FRONTEND_POOL);
+}
+
+static FORCEINLINE VOID
+__FrontendFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, FRONTEND_POOL);
+}
+
+PCHAR
+FrontendGetPath(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    return Frontend->Path;
+}
+
+// The ring accessors are only called with the console's spin lock held,
+// so none can be part way through when the channel is replaced on resume.
+BOOLEAN
+FrontendCanRead(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    PFRONTEND_SHARED        Shared = Frontend->Shared;
+
+    return (Shared->InConsumer != Shared->InProducer) ? TRUE : FALSE;
+}
+
+ULONG
+FrontendRead(
+    IN  PXENCONS_FRONTEND   Frontend,
+    IN  PCHAR               Data,
+    IN  ULONG               Length
+    )
+{
+    PFRONTEND_SHARED        Shared = Frontend->Shared;
+    ULONG                   Consumer;
+    ULONG                   Producer;
+    ULONG                   Read;
+
+    Consumer = Shared->InConsumer;
+    Producer = Shared->InProducer;
+    KeMemoryBarrier();
+
+    Read = 0;
+    while (Read < Length && Consumer != Producer) {
+        ULONG   Offset;
+        ULONG   Count;
+
+        Offset = Consumer & (FRONTEND_IN_SIZE - 1);
+        Count = __min(Producer - Consumer, FRONTEND_IN_SIZE - Offset);
+        Count = __min(Count, Length - Read);
+
+        RtlCopyMemory(&Data[Read], &Shared->In[Offset], Count);
+
+        Consumer += Count;
+        Read += Count;
+    }
+
+    if (Read == 0)
+        return 0;
+
+    KeMemoryBarrier();
+    Shared->InConsumer = Consumer;
+
+    if (Frontend->Channel != NULL)
+        XENBUS_EVTCHN(Send,
+                      &Frontend->EvtchnInterface,
+                      Frontend->Channel);
+
+    return Read;
+}
+
+BOOLEAN
+FrontendCanWrite(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    PFRONTEND_SHARED        Shared = Frontend->Shared;
+
+    return (Shared->OutProducer - Shared->OutConsumer < FRONTEND_OUT_SIZE) ?
+           TRUE :
+           FALSE;
+}
+
+ULONG
+FrontendWrite(
+    IN  PXENCONS_FRONTEND   Frontend,
+    IN  PCHAR               Data,
+    IN  ULONG               Length
+    )
+{
+    PFRONTEND_SHARED        Shared = Frontend->Shared;
+    ULONG                   Consumer;
+    ULONG                   Producer;
+    ULONG                   Written;
+
+    Consumer = Shared->OutConsumer;
+    Producer = Shared->OutProducer;
+    KeMemoryBarrier();
+
+    Written = 0;
+    while (Written < Length && Producer - Consumer < FRONTEND_OUT_SIZE) {
+        ULONG   Offset;
+        ULONG   Count;
+
+        Offset = Producer & (FRONTEND_OUT_SIZE - 1);
+        Count = __min(FRONTEND_OUT_SIZE - (Producer - Consumer),
+                      FRONTEND_OUT_SIZE - Offset);
+        Count = __min(Count, Length - Written);
+
+        RtlCopyMemory(&Shared->Out[Offset], &Data[Written], Count);
+
+        Producer += Count;
+        Written += Count;
+    }
+
+    if (Written == 0)
+        return 0;
+
+    KeMemoryBarrier();
+    Shared->OutProducer = Producer;
+
+    if (Frontend->Channel != NULL)
+        XENBUS_EVTCHN(Send,
+                      &Frontend->EvtchnInterface,
+                      Frontend->Channel);
+
+    return Written;
+}
+
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(DISPATCH_LEVEL)
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_sameIRQL
+static VOID
+FrontendDpc(
+    IN  PKDPC           Dpc,
+    IN  PVOID           Context,
+    IN  PVOID           Argument1,
+    IN  PVOID           Argument2
+    )
+{
+    PXENCONS_FRONTEND   Frontend = Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Frontend != NULL);
+
+    KeSetEvent(Frontend->Event, IO_NO_INCREMENT, FALSE);
+}
+
+static BOOLEAN
+FrontendEvtchnCallback(
+    IN  PKINTERRUPT     InterruptObject,
+    IN  PVOID           Argument
+    )
+{
+    PXENCONS_FRONTEND   Frontend = Argument;
+
+    UNREFERENCED_PARAMETER(InterruptObject);
+
+    ASSERT(Frontend != NULL);
+
+    (VOID) KeInsertQueueDpc(&Frontend->Dpc, NULL, NULL);
+
+    return TRUE;
+}
+
+__drv_requiresIRQL(DISPATCH_LEVEL)
+static VOID
+FrontendAcquireLock(
+    IN  PVOID           Argument
+    )
+{
+    PXENCONS_FRONTEND   Frontend = Argument;
+
+    KeAcquireSpinLockAtDpcLevel(&Frontend->Lock);
+}
+
+__drv_requiresIRQL(DISPATCH_LEVEL)
+static VOID
+FrontendReleaseLock(
+    IN  PVOID           Argument
+    )
+{
+    PXENCONS_FRONTEND   Frontend = Argument;
+
+#pragma prefast(suppress:26110)
+    KeReleaseSpinLockFromDpcLevel(&Frontend->Lock);
+}
+
+// Grant the backend access to the shared page and open an event channel
+// for it to bind.
+static NTSTATUS
+__FrontendConnectRing(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    PFN_NUMBER              Pfn;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    Pfn = MmGetMdlPfnArray(Frontend->Mdl)[0];
+
+    status = XENBUS_GNTTAB(PermitForeignAccess,
+                           &Frontend->GnttabInterface,
+                           Frontend->GnttabCache,
+                           FALSE,
+                           Frontend->BackendDomain,
+                           Pfn,
+                           FALSE,
+                           &Frontend->Entry);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Frontend->Channel = XENBUS_EVTCHN(Open,
+                                      &Frontend->EvtchnInterface,
+                                      XENBUS_EVTCHN_TYPE_UNBOUND,
+                                      FrontendEvtchnCallback,
+                                      Frontend,
+                                      Frontend->BackendDomain,
+                                      FALSE);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (Frontend->Channel == NULL)
+        goto fail2;
+
+    (VOID) XENBUS_EVTCHN(Unmask,
+                         &Frontend->EvtchnInterface,
+                         Frontend->Channel,
+                         FALSE,
+                         TRUE);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    (VOID) XENBUS_GNTTAB(RevokeForeignAccess,
+                         &Frontend->GnttabInterface,
+                         Frontend->GnttabCache,
+                         FALSE,
+                         Frontend->Entry);
+    Frontend->Entry = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+__FrontendDisconnectRing(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    if (Frontend->Channel != NULL) {
+        XENBUS_EVTCHN(Close,
+                      &Frontend->EvtchnInterface,
+                      Frontend->Channel);
+        Frontend->Channel = NULL;
+    }
+
+    if (Frontend->Entry != NULL) {
+        (VOID) XENBUS_GNTTAB(RevokeForeignAccess,
+                             &Frontend->GnttabInterface,
+                             Frontend->GnttabCache,
+                             FALSE,
+                             Frontend->Entry);
+        Frontend->Entry = NULL;
+    }
+}
+
+// Backends (xenconsoled and QEMU) map the ring as soon as ring-ref and
+// port are present with the frontend in Initialised or Connected, so
+// there is no need to wait for the backend before going to Connected.
+static NTSTATUS
+FrontendPublish(
+    IN  PXENCONS_FRONTEND       Frontend
+    )
+{
+    PXENBUS_STORE_TRANSACTION   Transaction;
+    ULONG                       Attempt;
+    NTSTATUS                    status;
+
+    Attempt = 0;
+    for (;;) {
+        status = XENBUS_STORE(TransactionStart,
+                              &Frontend->StoreInterface,
+                              &Transaction);
+        if (!NT_SUCCESS(status))
+            break;
+
+        status = XENBUS_STORE(Printf,
+                              &Frontend->StoreInterface,
+                              Transaction,
+                              Frontend->Path,
+                              "ring-ref",
+                              "%u",
+                              XENBUS_GNTTAB(GetReference,
+                                            &Frontend->GnttabInterface,
+                                            Frontend->Entry));
+        if (!NT_SUCCESS(status))
+            goto abort;
+
+        status = XENBUS_STORE(Printf,
+                              &Frontend->StoreInterface,
+                              Transaction,
+                              Frontend->Path,
+                              "port",
+                              "%u",
+                              XENBUS_EVTCHN(GetPort,
+                                            &Frontend->EvtchnInterface,
+                                            Frontend->Channel));
+        if (!NT_SUCCESS(status))
+            goto abort;
+
+        status = XENBUS_STORE(Printf,
+                              &Frontend->StoreInterface,
+                              Transaction,
+                              Frontend->Path,
+                              "state",
+                              "%u",
+                              FRONTEND_STATE_CONNECTED);
+        if (!NT_SUCCESS(status))
+            goto abort;
+
+        status = XENBUS_STORE(TransactionEnd,
+                              &Frontend->StoreInterface,
+                              Transaction,
+                              TRUE);
+        if (status != STATUS_RETRY || ++Attempt > FRONTEND_MAXIMUM_ATTEMPTS)
+            break;
+
+        continue;
+
+abort:
+        (VOID) XENBUS_STORE(TransactionEnd,
+                            &Frontend->StoreInterface,
+                            Transaction,
+                            FALSE);
+        break;
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Tell the backend the frontend is going away and give it a chance to
+// unmap the ring before access to it is revoked. The wait is woken by a
+// watch on the backend state, so it normally lasts only as long as the
+// backend takes to respond, and it is bounded in case it never does.
+static VOID
+FrontendClose(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    KEVENT                  Event;
+    PXENBUS_STORE_WATCH     Watch;
+    ULONG64                 Deadline;
+    NTSTATUS                status;
+
+    (VOID) XENBUS_STORE(Printf,
+                        &Frontend->StoreInterface,
+                        NULL,
+                        Frontend->Path,
+                        "state",
+                        "%u",
+                        FRONTEND_STATE_CLOSING);
+
+    KeInitializeEvent(&Event, NotificationEvent, FALSE);
+
+    status = XENBUS_STORE(WatchAdd,
+                          &Frontend->StoreInterface,
+                          Frontend->BackendPath,
+                          "state",
+                          &Event,
+                          &Watch);
+    if (!NT_SUCCESS(status))
+        goto done;
+
+    Deadline = KeQueryInterruptTime() + 10000ull * FRONTEND_CLOSE_TIMEOUT;
+
+    for (;;) {
+        PCHAR           Buffer;
+        ULONG           State;
+        ULONG64         Now;
+        LARGE_INTEGER   Timeout;
+
+        // Clear before reading so that a change made after the read
+        // still ends the wait
+        KeClearEvent(&Event);
+
+        status = XENBUS_STORE(Read,
+                              &Frontend->StoreInterface,
+                              NULL,
+                              Frontend->BackendPath,
+                              "state",
+                              &Buffer);
+        if (!NT_SUCCESS(status))
+            break;
+
+        State = strtoul(Buffer, NULL, 10);
+
+        XENBUS_STORE(Free,
+                     &Frontend->StoreInterface,
+                     Buffer);
+
+        if (State != FRONTEND_STATE_CONNECTED)
+            break;
+
+        Now = KeQueryInterruptTime();
+        if (Now >= Deadline) {
+            Warning("%s: backend did not disconnect\n", Frontend->Path);
+            break;
+        }
+
+        Timeout.QuadPart = -(LONGLONG)(Deadline - Now);
+
+        (VOID) KeWaitForSingleObject(&Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     &Timeout);
+    }
+
+    (VOID) XENBUS_STORE(WatchRemove,
+                        &Frontend->StoreInterface,
+                        Watch);
+
+done:
+    (VOID) XENBUS_STORE(Printf,
+                        &Frontend->StoreInterface,
+                        NULL,
+                        Frontend->Path,
+                        "state",
+                        "%u",
+                        FRONTEND_STATE_CLOSED);
+}
+
+// Event channels do not survive migration and the backend on the new
+// host has to be told where the ring is, so connect it afresh. Other
+// CPUs are corralled, and never with the console lock held, so the ring
+// is not in use.
+static DECLSPEC_NOINLINE VOID
+FrontendSuspendCallbackLate(
+    IN  PVOID           Argument
+    )
+{
+    PXENCONS_FRONTEND   Frontend = Argument;
+    NTSTATUS            status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    __FrontendDisconnectRing(Frontend);
+
+    status = __FrontendConnectRing(Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = FrontendPublish(Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    // Output may have been held up while the backend was away
+    KeSetEvent(Frontend->Event, IO_NO_INCREMENT, FALSE);
+
+    return;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+}
+
+NTSTATUS
+FrontendConnect(
+    IN  PXENCONS_FRONTEND   Frontend,
+    IN  PKEVENT             Event
+    )
+{
+    PCHAR                   Buffer;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    Trace("%s ====>\n", Frontend->Path);
+
+    ASSERT(!Frontend->Connected);
+
+    status = XENBUS_STORE(Acquire, &Frontend->StoreInterface);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = XENBUS_SUSPEND(Acquire, &Frontend->SuspendInterface);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_EVTCHN(Acquire, &Frontend->EvtchnInterface);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    status = XENBUS_GNTTAB(Acquire, &Frontend->GnttabInterface);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    status = XENBUS_STORE(Read,
+                          &Frontend->StoreInterface,
+                          NULL,
+                          Frontend->Path,
+                          "backend",
+                          &Frontend->BackendPath);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    status = XENBUS_STORE(Read,
+                          &Frontend->StoreInterface,
+                          NULL,
+                          Frontend->Path,
+                          "backend-id",
+                          &Buffer);
+    if (NT_SUCCESS(status)) {
+        Frontend->BackendDomain = (USHORT)strtoul(Buffer, NULL, 10);
+
+        XENBUS_STORE(Free,
+                     &Frontend->StoreInterface,
+                     Buffer);
+    } else {
+        Frontend->BackendDomain = 0;
+    }
+
+    status = XENBUS_GNTTAB(CreateCache,
+                           &Frontend->GnttabInterface,
+                           Frontend->Path,
+                           0,
+                           0,
+                           FrontendAcquireLock,
+                           FrontendReleaseLock,
+                           Frontend,
+                           &Frontend->GnttabCache);
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
+    Frontend->Event = Event;
+
+    // Whatever a previous backend left in the ring is of no interest
+    RtlZeroMemory(Frontend->Shared, sizeof (FRONTEND_SHARED));
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    status = __FrontendConnectRing(Frontend);
+    KeLowerIrql(Irql);
+
+    if (!NT_SUCCESS(status))
+        goto fail7;
+
+    status = FrontendPublish(Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail8;
+
+    status = XENBUS_SUSPEND(Register,
+                            &Frontend->SuspendInterface,
+                            SUSPEND_CALLBACK_LATE,
+                            FrontendSuspendCallbackLate,
+                            Frontend,
+                            &Frontend->SuspendCallbackLate);
+    if (!NT_SUCCESS(status))
+        goto fail9;
+
+    Frontend->Connected = TRUE;
+
+    Info("%s: connected (backend %s domain %u)\n",
+         Frontend->Path,
+         Frontend->BackendPath,
+         Frontend->BackendDomain);
+
+    Trace("%s <====\n", Frontend->Path);
+
+    return STATUS_SUCCESS;
+
+fail9:
+    Error("fail9\n");
+
+    FrontendClose(Frontend);
+
+fail8:
+    Error("fail8\n");
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    __FrontendDisconnectRing(Frontend);
+    KeLowerIrql(Irql);
+
+    KeFlushQueuedDpcs();
+
+fail7:
+    Error("fail7\n");
+
+    Frontend->Event = NULL;
+
+    XENBUS_GNTTAB(DestroyCache,
+                  &Frontend->GnttabInterface,
+                  Frontend->GnttabCache);
+    Frontend->GnttabCache = NULL;
+
+fail6:
+    Error("fail6\n");
+
+    Frontend->BackendDomain = 0;
+
+    XENBUS_STORE(Free,
+                 &Frontend->StoreInterface,
+                 Frontend->BackendPath);
+    Frontend->BackendPath = NULL;
+
+fail5:
+    Error("fail5\n");
+
+    XENBUS_GNTTAB(Release, &Frontend->GnttabInterface);
+
+fail4:
+    Error("fail4\n");
+
+    XENBUS_EVTCHN(Release, &Frontend->EvtchnInterface);
+
+fail3:
+    Error("fail3\n");
+
+    XENBUS_SUSPEND(Release, &Frontend->SuspendInterface);
+
+fail2:
+    Error("fail2\n");
+
+    XENBUS_STORE(Release, &Frontend->StoreInterface);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+FrontendDisconnect(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    KIRQL                   Irql;
+
+    Trace("%s ====>\n", Frontend->Path);
+
+    ASSERT(Frontend->Connected);
+    Frontend->Connected = FALSE;
+
+    XENBUS_SUSPEND(Deregister,
+                   &Frontend->SuspendInterface,
+                   Frontend->SuspendCallbackLate);
+    Frontend->SuspendCallbackLate = NULL;
+
+    FrontendClose(Frontend);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    __FrontendDisconnectRing(Frontend);
+    KeLowerIrql(Irql);
+
+    // The channel is closed, so once any DPC it queued has run the event
+    // will not be touched again
+    KeFlushQueuedDpcs();
+
+    Frontend->Event = NULL;
+
+    XENBUS_GNTTAB(DestroyCache,
+                  &Frontend->GnttabInterface,
+                  Frontend->GnttabCache);
+    Frontend->GnttabCache = NULL;
+
+    Frontend->BackendDomain = 0;
+
+    XENBUS_STORE(Free,
+                 &Frontend->StoreInterface,
+                 Frontend->BackendPath);
+    Frontend->BackendPath = NULL;
+
+    XENBUS_GNTTAB(Release, &Frontend->GnttabInterface);
+
+    XENBUS_EVTCHN(Release, &Frontend->EvtchnInterface);
+
+    XENBUS_SUSPEND(Release, &Frontend->SuspendInterface);
+
+    XENBUS_STORE(Release, &Frontend->StoreInterface);
+
+    Trace("%s <====\n", Frontend->Path);
+}
+
+NTSTATUS
+FrontendCreate(
+    IN  PXENCONS_FDO        Fdo,
+    IN  PCHAR               Name,
+    OUT PXENCONS_FRONTEND   *Frontend
+    )
+{
+    NTSTATUS                status;
+
+    *Frontend = __FrontendAllocate(sizeof (XENCONS_FRONTEND));
+
+    status = STATUS_NO_MEMORY;
+    if (*Frontend == NULL)
+        goto fail1;
+
+    status = RtlStringCbPrintfA((*Frontend)->Path,
+                                MAXNAMELEN,
+                                "device/console/%s",
+                                Name);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    (*Frontend)->Mdl = __AllocatePage();
+
+    status = STATUS_NO_MEMORY;
+    if ((*Frontend)->Mdl == NULL)
+        goto fail3;
+
+    (*Frontend)->Shared = (*Frontend)->Mdl->MappedSystemVa;
+    ASSERT((*Frontend)->Shared != NULL);
+
+    FdoGetStoreInterface(Fdo, &(*Frontend)->StoreInterface);
+    FdoGetSuspendInterface(Fdo, &(*Frontend)->SuspendInterface);
+    FdoGetEvtchnInterface(Fdo, &(*Frontend)->EvtchnInterface);
+    FdoGetGnttabInterface(Fdo, &(*Frontend)->GnttabInterface);
+
+    KeInitializeSpinLock(&(*Frontend)->Lock);
+    KeInitializeDpc(&(*Frontend)->Dpc, FrontendDpc, *Frontend);
+
+    (*Frontend)->Fdo = Fdo;
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+    RtlZeroMemory((*Frontend)->Path, MAXNAMELEN);
+
+    ASSERT(IsZeroMemory(*Frontend, sizeof (XENCONS_FRONTEND)));
+    __FrontendFree(*Frontend);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+FrontendDestroy(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    ASSERT(!Frontend->Connected);
+
+    Frontend->Fdo = NULL;
+
+    RtlZeroMemory(&Frontend->Dpc, sizeof (KDPC));
+    RtlZeroMemory(&Frontend->Lock, sizeof (KSPIN_LOCK));
+
+    RtlZeroMemory(&Frontend->GnttabInterface,
+                  sizeof (XENBUS_GNTTAB_INTERFACE));
+
+    RtlZeroMemory(&Frontend->EvtchnInterface,
+                  sizeof (XENBUS_EVTCHN_INTERFACE));
+
+    RtlZeroMemory(&Frontend->SuspendInterface,
+                  sizeof (XENBUS_SUSPEND_INTERFACE));
+
+    RtlZeroMemory(&Frontend->StoreInterface,
+                  sizeof (XENBUS_STORE_INTERFACE));
+
+    Frontend->Shared = NULL;
+
+    __FreePage(Frontend->Mdl);
+    Frontend->Mdl = NULL;
+
+    RtlZeroMemory(Frontend->Path, MAXNAMELEN);
+
+    ASSERT(IsZeroMemory(Frontend, sizeof (XENCONS_FRONTEND)));
+    __FrontendFree(Frontend);
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENCONS_FRONTEND_H
+#define _XENCONS_FRONTEND_H
+
+#include <ntddk.h>
+
+typedef struct _XENCONS_FRONTEND XENCONS_FRONTEND, *PXENCONS_FRONTEND;
+
+#include "fdo.h"
+
+extern NTSTATUS
+FrontendCreate(
+    IN  PXENCONS_FDO        Fdo,
+    IN  PCHAR               Name,
+    OUT PXENCONS_FRONTEND   *Frontend
+    );
+
+extern VOID
+FrontendDestroy(
+    IN  PXENCONS_FRONTEND   Frontend
+    );
+
+extern NTSTATUS
+FrontendConnect(
+    IN  PXENCONS_FRONTEND   Frontend,
+    IN  PKEVENT             Event
+    );
+
+extern VOID
+FrontendDisconnect(
+    IN  PXENCONS_FRONTEND   Frontend
+    );
+
+extern PCHAR
+FrontendGetPath(
+    IN  PXENCONS_FRONTEND   Frontend
+    );
+
+extern BOOLEAN
+FrontendCanRead(
+    IN  PXENCONS_FRONTEND   Frontend
+    );
+
+extern ULONG
+FrontendRead(
+    IN  PXENCONS_FRONTEND   Frontend,
+    IN  PCHAR               Data,
+    IN  ULONG               Length
+    );
+
+extern BOOLEAN
+FrontendCanWrite(
+    IN  PXENCONS_FRONTEND   Frontend
+    );
+
+extern ULONG
+FrontendWrite(
+    IN  PXENCONS_FRONTEND   Frontend,
+    IN  PCHAR               Data,
+    IN  ULONG               Length
+    );
+
+#endif  // _XENCONS_FRONTEND_H
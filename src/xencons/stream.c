@@ -30,26 +30,110 @@
  */
 
 #include <ntddk.h>
+#include <stdlib.h>
+#include <xencons_device.h>
 
 #include "fdo.h"
+#include "console.h"
 #include "stream.h"
-#include "thread.h"
-#include "names.h"
+#include "trace.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
 #define STREAM_POOL 'ETRS'
 
+// IRP state kept in Tail.Overlay.DriverContext. The CSQ owns slot 3.
+#define STREAM_IRP_ARRIVED  0   // Timestamp of arrival
+#define STREAM_IRP_ATTEMPT  1   // Timestamp of first transfer attempt
+#define STREAM_IRP_STARTED  2   // Time of first attempt, for read timeouts
+
+#define STREAM_RING_SIZE    (4 * PAGE_SIZE)
+#define STREAM_RING_PAGES   (1 + 2 * (STREAM_RING_SIZE / PAGE_SIZE))
+
+#define STREAM_RING_RECEIVE_OFFSET  PAGE_SIZE
+#define STREAM_RING_TRANSMIT_OFFSET (PAGE_SIZE + STREAM_RING_SIZE)
+
+// The segments of a vectored write are not needed once they have been
+// gathered, so the system buffer holds a pointer to the gathered data in
+// their place.
+typedef struct _STREAM_GATHER {
+    ULONG   Length;
+    CHAR    Buffer[1];
+} STREAM_GATHER, *PSTREAM_GATHER;
+
+// Queues are polled in this order, so priority writes go first.
+typedef enum _STREAM_QUEUE_TYPE {
+    STREAM_QUEUE_PRIORITY = 0,
+    STREAM_QUEUE_READ,
+    STREAM_QUEUE_WRITE,
+    STREAM_QUEUE_COUNT
+} STREAM_QUEUE_TYPE, *PSTREAM_QUEUE_TYPE;
+
+// New IRPs are pushed onto the lock-free Submitted list, newest first,
+// and taken off all at once by whoever holds the queue. Only IRPs that
+// have to wait are parked on the cancel-safe queue, so the CSQ lock is
+// not taken on the common path. Depth counts IRPs in either place.
+typedef struct _STREAM_QUEUE {
+    PXENCONS_STREAM Stream;
+    PIRP            Submitted;
+    IO_CSQ          Csq;
+    LIST_ENTRY      List;
+    KSPIN_LOCK      Lock;
+    LONG            Busy;
+    LONG            Depth;
+} STREAM_QUEUE, *PSTREAM_QUEUE;
+
 struct _XENCONS_STREAM {
-    PXENCONS_FDO            	Fdo;
-    PXENCONS_THREAD         	Thread;
-    IO_CSQ                  	Csq;
-    LIST_ENTRY              	List;
-    KSPIN_LOCK           	Lock;
-    XENBUS_CONSOLE_INTERFACE 	ConsoleInterface;
+    PXENCONS_FDO                Fdo;
+    PXENCONS_CONSOLE            Console;
+    BOOLEAN                     Readable;
+    BOOLEAN                     Writable;
+    STREAM_QUEUE                Queue[STREAM_QUEUE_COUNT];
+    BOOLEAN                     WriteWhole;
+    ULONG64                     WriteSequence;
+    XENCONS_READ_TIMEOUTS       ReadTimeouts;
+    BOOLEAN                     LineMode;
+    ULONG                       LineDelimiters[256 / 32];
+    ULONG                       LineScanned;
+    KTIMER                      ReadTimer;
+    KDPC                        ReadDpc;
+    KSPIN_LOCK                  Lock;
+    ULONG                       Producer;
+    ULONG                       Consumer;
+    ULONG                       ReceiveTime;
+    BOOLEAN                     ReceiveOverflow;
+    PCHAR                       Buffer;
+    ULONG                       BufferSize;
+    PMDL                        RingMdl;
+    PXENCONS_RING_HEADER        RingHeader;
+    PCHAR                       RingReceive;
+    PCHAR                       RingTransmit;
+    PVOID                       RingAddress;
+    LIST_ENTRY                  RingListEntry;
+    PEPROCESS                   RingProcess;
+    PKEVENT                     RingEvent;
+    ULONG                       RingReceiveProducer;
+    ULONG                       RingTransmitConsumer;
+    XENCONS_STATISTICS          Statistics;
+    PXENCONS_STATISTICS         DeviceStatistics;
+    PXENCONS_LATENCY            Latency;
 };
 
+C_ASSERT((STREAM_RING_SIZE & (STREAM_RING_SIZE - 1)) == 0);
+C_ASSERT(sizeof (XENCONS_RING_HEADER) <= PAGE_SIZE);
+C_ASSERT(sizeof (XENCONS_WRITE_SEGMENT) >= sizeof (PSTREAM_GATHER));
+
+// Streams whose rings are mapped into a process, so that the mapping
+// can be removed if that process exits while the handle lives on in
+// another one.
+typedef struct _XENCONS_STREAM_MAPPINGS {
+    FAST_MUTEX  Mutex;
+    LIST_ENTRY  List;
+} XENCONS_STREAM_MAPPINGS, *PXENCONS_STREAM_MAPPINGS;
+
+static XENCONS_STREAM_MAPPINGS  StreamMappings;
+
 static FORCEINLINE PVOID
 __StreamAllocate(
     IN  ULONG   Length
@@ -66,6 +150,91 @@ __StreamFree(
     __FreePoolWithTag(Buffer, STREAM_POOL);
 }
 
+static FORCEINLINE BOOLEAN
+__StreamIsWriteVector(
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    return (StackLocation->MajorFunction == IRP_MJ_DEVICE_CONTROL &&
+            StackLocation->Parameters.DeviceIoControl.IoControlCode ==
+            IOCTL_XENCONS_WRITE_VECTOR) ?
+           TRUE :
+           FALSE;
+}
+
+static FORCEINLINE VOID
+__StreamFreeGather(
+    IN  PIRP        Irp
+    )
+{
+    PSTREAM_GATHER  *Gather = Irp->AssociatedIrp.SystemBuffer;
+
+    __StreamFree(*Gather);
+    *Gather = NULL;
+}
+
+// Counters are kept for the handle and for the device as a whole.
+#define STREAM_STATISTIC_ADD(_Stream, _Field, _Value)                       \
+    do {                                                                    \
+        (VOID) InterlockedExchangeAdd64(                                    \
+                    (PLONG64)&(_Stream)->Statistics._Field,                 \
+                    (LONG64)(_Value));                                      \
+        (VOID) InterlockedExchangeAdd64(                                    \
+                    (PLONG64)&(_Stream)->DeviceStatistics->_Field,          \
+                    (LONG64)(_Value));                                      \
+    } while (FALSE)
+
+static FORCEINLINE VOID
+__StreamHighWater(
+    IN  PULONG  Mark,
+    IN  ULONG   Value
+    )
+{
+    for (;;) {
+        ULONG   Old = *(volatile ULONG *)Mark;
+
+        if (Value <= Old ||
+            (ULONG)InterlockedCompareExchange((PLONG)Mark,
+                                              (LONG)Value,
+                                              (LONG)Old) == Old)
+            break;
+    }
+}
+
+// Microseconds, for latency measurement. The bottom bit is always set
+// so that a timestamp is never zero. Only ever used for differences so
+// wrapping is harmless.
+static FORCEINLINE ULONG
+__StreamGetTimestamp(
+    VOID
+    )
+{
+    LARGE_INTEGER   Counter;
+    LARGE_INTEGER   Frequency;
+    ULONG64         Microseconds;
+
+    Counter = KeQueryPerformanceCounter(&Frequency);
+
+    Microseconds = ((Counter.QuadPart / Frequency.QuadPart) * 1000000ull) +
+                   (((Counter.QuadPart % Frequency.QuadPart) * 1000000ull) /
+                    Frequency.QuadPart);
+
+    return (ULONG)Microseconds | 1;
+}
+
+// Milliseconds; only ever used for differences so wrapping is harmless.
+static FORCEINLINE ULONG
+__StreamGetTime(
+    VOID
+    )
+{
+    return (ULONG)(KeQueryInterruptTime() / 10000ull);
+}
+
 IO_CSQ_INSERT_IRP_EX StreamCsqInsertIrpEx;
 
 NTSTATUS
@@ -76,18 +245,17 @@ StreamCsqInsertIrpEx(
     )
 {
     BOOLEAN             ReInsert = (BOOLEAN)(ULONG_PTR)InsertContext;
-    PXENCONS_STREAM     Stream;
+    PSTREAM_QUEUE       Queue;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
 
-    if (ReInsert) {
-        // This only occurs if the worker thread de-queued the IRP but
-        // then found the console to be blocked.
-        InsertHeadList(&Stream->List, &Irp->Tail.Overlay.ListEntry);
-    } else {
-        InsertTailList(&Stream->List, &Irp->Tail.Overlay.ListEntry);
-        ThreadWake(Stream->Thread);
-    }
+    // IRPs are only ever inserted by the holder of the queue: either one
+    // that was de-queued and then found the console to be blocked, which
+    // goes back at the head, or ones parked from the submission list.
+    if (ReInsert)
+        InsertHeadList(&Queue->List, &Irp->Tail.Overlay.ListEntry);
+    else
+        InsertTailList(&Queue->List, &Irp->Tail.Overlay.ListEntry);
 
     return STATUS_SUCCESS;
 }
@@ -96,8 +264,8 @@ IO_CSQ_REMOVE_IRP StreamCsqRemoveIrp;
 
 VOID
 StreamCsqRemoveIrp(
-    IN  PIO_CSQ Csq,
-    IN  PIRP    Irp
+    IN  PIO_CSQ     Csq,
+    IN  PIRP        Irp
     )
 {
     UNREFERENCED_PARAMETER(Csq);
@@ -114,19 +282,19 @@ StreamCsqPeekNextIrp(
     IN  PVOID       PeekContext OPTIONAL
     )
 {
-    PXENCONS_STREAM Stream;
+    PSTREAM_QUEUE   Queue;
     PLIST_ENTRY     ListEntry;
     PIRP            NextIrp;
 
     UNREFERENCED_PARAMETER(PeekContext);
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
 
     ListEntry = (Irp == NULL) ?
-                Stream->List.Flink :
+                Queue->List.Flink :
                 Irp->Tail.Overlay.ListEntry.Flink;
 
-    if (ListEntry == &Stream->List)
+    if (ListEntry == &Queue->List)
         return NULL;
 
     NextIrp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
@@ -145,11 +313,11 @@ StreamCsqAcquireLock(
     OUT PKIRQL  Irql
     )
 {
-    PXENCONS_STREAM Stream;
+    PSTREAM_QUEUE   Queue;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
 
-    KeAcquireSpinLock(&Stream->Lock, Irql);
+    KeAcquireSpinLock(&Queue->Lock, Irql);
 }
 
 IO_CSQ_RELEASE_LOCK StreamCsqReleaseLock;
@@ -160,11 +328,11 @@ StreamCsqReleaseLock(
     IN  KIRQL   Irql
     )
 {
-    PXENCONS_STREAM Stream;
+    PSTREAM_QUEUE   Queue;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
 
-    KeReleaseSpinLock(&Stream->Lock, Irql);
+    KeReleaseSpinLock(&Queue->Lock, Irql);
 }
 
 #pragma warning(pop)
@@ -177,276 +345,1977 @@ StreamCsqCompleteCanceledIrp(
     IN  PIRP    Irp
     )
 {
+    PSTREAM_QUEUE       Queue;
     PIO_STACK_LOCATION  StackLocation;
     UCHAR               MajorFunction;
 
-    UNREFERENCED_PARAMETER(Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
     MajorFunction = StackLocation->MajorFunction;
 
-    Irp->IoStatus.Information = 0;
+    ASSERT(Queue->Depth != 0);
+    (VOID) InterlockedDecrement(&Queue->Depth);
+
+    STREAM_STATISTIC_ADD(Queue->Stream, RequestsCancelled, 1);
+
+    if (__StreamIsWriteVector(Irp))
+        __StreamFreeGather(Irp);
+
+    // A whole-length write may already have buffered some of its data.
+    if (MajorFunction != IRP_MJ_WRITE)
+        Irp->IoStatus.Information = 0;
     Irp->IoStatus.Status = STATUS_CANCELLED;
 
-    Trace("CANCELLED (%02x:%s)\n",
-          MajorFunction,
-          MajorFunctionName(MajorFunction));
+    TraceEvent(XENCONS_TRACE_CANCEL,
+               MajorFunction,
+               (ULONG)Irp->IoStatus.Information,
+               0);
 
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
 }
 
 static NTSTATUS
-StreamWorker(
-    IN  PXENCONS_THREAD     Self,
-    IN  PVOID               Context
+StreamQueueInitialize(
+    IN  PXENCONS_STREAM Stream,
+    IN  PSTREAM_QUEUE   Queue
     )
 {
-    PXENCONS_STREAM         Stream = Context;
-    PKEVENT                 Event;
-    PXENBUS_CONSOLE_WAKEUP  Wakeup;
-    NTSTATUS                status;
-
-    Trace("====>\n");
+    NTSTATUS            status;
 
-    Event = ThreadGetEvent(Self);
+    KeInitializeSpinLock(&Queue->Lock);
+    InitializeListHead(&Queue->List);
 
-    status = XENBUS_CONSOLE(Acquire,
-                            &Stream->ConsoleInterface);
+    status = IoCsqInitializeEx(&Queue->Csq,
+                               StreamCsqInsertIrpEx,
+                               StreamCsqRemoveIrp,
+                               StreamCsqPeekNextIrp,
+                               StreamCsqAcquireLock,
+                               StreamCsqReleaseLock,
+                               StreamCsqCompleteCanceledIrp);
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    status = XENBUS_CONSOLE(WakeupAdd,
-                            &Stream->ConsoleInterface,
-                            Event,
-                            &Wakeup);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    Queue->Stream = Stream;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    RtlZeroMemory(&Queue->List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Queue->Lock, sizeof (KSPIN_LOCK));
+
+    return status;
+}
+
+// While an IRP is on the submission list its CSQ list entry is unused,
+// so the forward link is borrowed to chain it.
+static FORCEINLINE PIRP
+__StreamIrpGetNext(
+    IN  PIRP    Irp
+    )
+{
+    return (PIRP)Irp->Tail.Overlay.ListEntry.Flink;
+}
+
+static FORCEINLINE VOID
+__StreamIrpSetNext(
+    IN  PIRP    Irp,
+    IN  PIRP    Next
+    )
+{
+    Irp->Tail.Overlay.ListEntry.Flink = (PLIST_ENTRY)Next;
+}
+
+static VOID
+__StreamQueuePush(
+    IN  PSTREAM_QUEUE   Queue,
+    IN  PIRP            Irp
+    )
+{
+    PIRP                Head;
+
+    do {
+        Head = *(PIRP volatile *)&Queue->Submitted;
+        __StreamIrpSetNext(Irp, Head);
+    } while (InterlockedCompareExchangePointer(&Queue->Submitted,
+                                               Irp,
+                                               Head) != Head);
+}
+
+// Take everything off the submission list, returning it oldest first.
+static PIRP
+__StreamQueueSplice(
+    IN  PSTREAM_QUEUE   Queue
+    )
+{
+    PIRP                Irp;
+    PIRP                Batch;
+
+    Irp = InterlockedExchangePointer(&Queue->Submitted, NULL);
+
+    Batch = NULL;
+    while (Irp != NULL) {
+        PIRP    Next = __StreamIrpGetNext(Irp);
+
+        __StreamIrpSetNext(Irp, Batch);
+        Batch = Irp;
+        Irp = Next;
+    }
+
+    return Batch;
+}
+
+// Move a batch onto the back of the cancel-safe queue, where it can be
+// cancelled. An IRP that has already been cancelled is completed by the
+// CSQ as it is inserted.
+static VOID
+__StreamQueuePark(
+    IN  PSTREAM_QUEUE   Queue,
+    IN  PIRP            Batch
+    )
+{
+    while (Batch != NULL) {
+        PIRP        Irp = Batch;
+        NTSTATUS    status;
+
+        Batch = __StreamIrpGetNext(Irp);
+        __StreamIrpSetNext(Irp, NULL);
+
+        status = IoCsqInsertIrpEx(&Queue->Csq, Irp, NULL, (PVOID)FALSE);
+        ASSERT(NT_SUCCESS(status));
+    }
+}
+
+static VOID
+StreamQueueTeardown(
+    IN  PSTREAM_QUEUE   Queue
+    )
+{
+    __StreamQueuePark(Queue, __StreamQueueSplice(Queue));
 
     for (;;) {
         PIRP    Irp;
 
-        (VOID) KeWaitForSingleObject(Event,
-                                     Executive,
-                                     KernelMode,
-                                     FALSE,
-                                     NULL);
-        KeClearEvent(Event);
-
-        if (ThreadIsAlerted(Self))
+        Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL);
+        if (Irp == NULL)
             break;
 
-        for (Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL);
-             Irp != NULL;
-             Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL)) {
-            PIO_STACK_LOCATION  StackLocation;
-            UCHAR               MajorFunction;
-            BOOLEAN             Blocked;
+        StreamCsqCompleteCanceledIrp(&Queue->Csq,
+                                     Irp);
+    }
+    ASSERT(IsListEmpty(&Queue->List));
+    ASSERT3P(Queue->Submitted, ==, NULL);
+
+    Queue->Stream = NULL;
 
-            StackLocation = IoGetCurrentIrpStackLocation(Irp);
-            MajorFunction = StackLocation->MajorFunction;
+    RtlZeroMemory(&Queue->Csq, sizeof (IO_CSQ));
 
-            switch (MajorFunction) {
-            case IRP_MJ_READ:
-                Blocked = !XENBUS_CONSOLE(CanRead,
-                                          &Stream->ConsoleInterface);
-                break;
+    ASSERT3U(Queue->Depth, ==, 0);
 
-            case IRP_MJ_WRITE:
-                Blocked = !XENBUS_CONSOLE(CanWrite,
-                                          &Stream->ConsoleInterface);
-                break;
+    RtlZeroMemory(&Queue->List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Queue->Lock, sizeof (KSPIN_LOCK));
+}
 
-            default:
-                ASSERT(FALSE);
+// Only one context at a time may move data for a given queue, otherwise
+// an IRP completed inline by the dispatch routine could overtake one
+// that the console worker thread has already de-queued. An inline claim
+// is also refused if there are IRPs queued ahead of the caller.
+static BOOLEAN
+__StreamQueueClaim(
+    IN  PSTREAM_QUEUE   Queue,
+    IN  BOOLEAN         Inline
+    )
+{
+    if (Inline && *(volatile LONG *)&Queue->Depth != 0)
+        return FALSE;
 
-                Blocked = TRUE;
-                break;
-            }
+    return (InterlockedCompareExchange(&Queue->Busy, TRUE, FALSE) == FALSE) ?
+           TRUE :
+           FALSE;
+}
 
-            if (Blocked) {
-                status = IoCsqInsertIrpEx(&Stream->Csq,
-                                          Irp,
-                                          NULL,
-                                          (PVOID)TRUE);
-                ASSERT(NT_SUCCESS(status));
+static VOID
+__StreamQueueRelease(
+    IN  PSTREAM_QUEUE   Queue,
+    IN  BOOLEAN         Inline
+    )
+{
+    ASSERT(Queue->Busy);
+    (VOID) InterlockedExchange(&Queue->Busy, FALSE);
 
-                break;
-            }
+    // The worker thread may have skipped the queue while it was claimed
+    // inline so make sure it takes another look.
+    if (Inline && *(volatile LONG *)&Queue->Depth != 0)
+        ConsoleWake(Queue->Stream->Console);
+}
 
-            switch (MajorFunction) {
-            case IRP_MJ_READ: {
-                ULONG   Length;
-                PCHAR   Buffer;
-                ULONG   Read;
+BOOLEAN
+StreamIsReadable(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    return Stream->Readable;
+}
 
-                Length = StackLocation->Parameters.Read.Length;
-                Buffer = Irp->AssociatedIrp.SystemBuffer;
+// Every reader gets its own copy of the input. If the stream's buffer
+// is full, whatever does not fit is dropped and counted against this
+// handle alone, so a reader that stops reading cannot hold up the others.
+VOID
+StreamReceive(
+    IN  PXENCONS_STREAM Stream,
+    IN  PCHAR           Buffer,
+    IN  ULONG           Length
+    )
+{
+    KIRQL               Irql;
+    ULONG               Space;
+    ULONG               Dropped;
 
-                Read = XENBUS_CONSOLE(Read,
-                                      &Stream->ConsoleInterface,
-                                      Buffer,
-                                      Length);
+    KeAcquireSpinLock(&Stream->Lock, &Irql);
 
-                Irp->IoStatus.Information = Read;
-                Irp->IoStatus.Status = STATUS_SUCCESS;
-                break;
-            }
-            case IRP_MJ_WRITE: {
-                ULONG   Length;
-                PCHAR   Buffer;
-                ULONG   Written;
-
-                Length = StackLocation->Parameters.Write.Length;
-                Buffer = Irp->AssociatedIrp.SystemBuffer;
-
-                Written = XENBUS_CONSOLE(Write,
-                                         &Stream->ConsoleInterface,
-                                         Buffer,
-                                         Length);
-
-                Irp->IoStatus.Information = Written;
-                Irp->IoStatus.Status = STATUS_SUCCESS;
-                break;
-            }
-            default:
-                ASSERT(FALSE);
+    Space = Stream->BufferSize - (Stream->Producer - Stream->Consumer);
 
-                Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
-                break;
-            }
+    Dropped = (Length > Space) ? Length - Space : 0;
+    Length -= Dropped;
 
-            Trace("COMPLETE (%02x:%s) (%u bytes)\n",
-                  MajorFunction,
-                  MajorFunctionName(MajorFunction),
-                  Irp->IoStatus.Information);
+    if (Dropped != 0) {
+        (VOID) InterlockedExchangeAdd64(
+                    (PLONG64)&Stream->Statistics.ReceiveDropped,
+                    (LONG64)Dropped);
 
-            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        if (!Stream->ReceiveOverflow) {
+            Stream->ReceiveOverflow = TRUE;
+            (VOID) InterlockedIncrement(
+                        (PLONG)&Stream->Statistics.ReceiveOverflows);
         }
+    } else if (Length < Space) {
+        Stream->ReceiveOverflow = FALSE;
     }
 
-    XENBUS_CONSOLE(WakeupRemove,
-                   &Stream->ConsoleInterface,
-                   Wakeup);
+    while (Length != 0) {
+        ULONG   Offset;
+        ULONG   Count;
 
-    XENBUS_CONSOLE(Release, &Stream->ConsoleInterface);
+        Offset = Stream->Producer & (Stream->BufferSize - 1);
+        Count = __min(Length, Stream->BufferSize - Offset);
 
-    Trace("<====\n");
+        RtlCopyMemory(&Stream->Buffer[Offset], Buffer, Count);
 
-    return STATUS_SUCCESS;
+        Stream->Producer += Count;
+        Buffer += Count;
+        Length -= Count;
+    }
 
-fail2:
-    Error("fail2\n");
+    Stream->ReceiveTime = __StreamGetTime();
 
-    XENBUS_CONSOLE(Release, &Stream->ConsoleInterface);
+    KeReleaseSpinLock(&Stream->Lock, Irql);
+}
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+static ULONG
+__StreamCopyOutLocked(
+    IN  PXENCONS_STREAM Stream,
+    IN  PCHAR           Buffer,
+    IN  ULONG           Length
+    )
+{
+    ULONG               Copied;
 
-    return status;
+    Length = __min(Length, Stream->Producer - Stream->Consumer);
+    Copied = 0;
+
+    while (Length != 0) {
+        ULONG   Offset;
+        ULONG   Count;
+
+        Offset = Stream->Consumer & (Stream->BufferSize - 1);
+        Count = __min(Length, Stream->BufferSize - Offset);
+
+        RtlCopyMemory(Buffer, &Stream->Buffer[Offset], Count);
+
+        Stream->Consumer += Count;
+        Copied += Count;
+        Buffer += Count;
+        Length -= Count;
+    }
+
+    return Copied;
 }
 
-NTSTATUS
-StreamCreate(
-    IN  PXENCONS_FDO    Fdo,
-    OUT PXENCONS_STREAM *Stream
+// Copy buffered input out to the caller. Returns FALSE, without
+// copying anything, if there is no input buffered.
+static BOOLEAN
+__StreamCopyOut(
+    IN  PXENCONS_STREAM Stream,
+    IN  PCHAR           Buffer,
+    IN  ULONG           Length,
+    OUT PULONG          Copied
     )
 {
-    NTSTATUS            status;
+    KIRQL               Irql;
+    BOOLEAN             Available;
 
-    *Stream = __StreamAllocate(sizeof (XENCONS_STREAM));
+    *Copied = 0;
 
-    status = STATUS_NO_MEMORY;
-    if (*Stream == NULL)
-        goto fail1;
+    KeAcquireSpinLock(&Stream->Lock, &Irql);
 
-    FdoGetConsoleInterface(Fdo, &(*Stream)->ConsoleInterface);
+    Available = (Stream->Producer != Stream->Consumer);
+    if (Available)
+        *Copied = __StreamCopyOutLocked(Stream, Buffer, Length);
 
-    KeInitializeSpinLock(&(*Stream)->Lock);
-    InitializeListHead(&(*Stream)->List);
+    KeReleaseSpinLock(&Stream->Lock, Irql);
 
-    status = IoCsqInitializeEx(&(*Stream)->Csq,
-                               StreamCsqInsertIrpEx,
-                               StreamCsqRemoveIrp,
-                               StreamCsqPeekNextIrp,
-                               StreamCsqAcquireLock,
-                               StreamCsqReleaseLock,
-                               StreamCsqCompleteCanceledIrp);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    return Available;
+}
 
-    status = ThreadCreate(StreamWorker,
-                          *Stream,
-                          &(*Stream)->Thread);
-    if (!NT_SUCCESS(status))
-        goto fail3;
+static FORCEINLINE BOOLEAN
+__StreamIsDelimiter(
+    IN  PXENCONS_STREAM Stream,
+    IN  UCHAR           Character
+    )
+{
+    return (Stream->LineDelimiters[Character >> 5] &
+            (1ul << (Character & 31))) ? TRUE : FALSE;
+}
 
-    (*Stream)->Fdo = Fdo;
+// Look for a delimiter in the buffered input and return the length of
+// the line it ends, or zero if there is no complete line. Input that has
+// already been searched is not searched again.
+static ULONG
+__StreamGetLineLocked(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    ULONG               Index;
 
-    return STATUS_SUCCESS;
+    if ((LONG)(Stream->LineScanned - Stream->Consumer) < 0)
+        Stream->LineScanned = Stream->Consumer;
 
-fail3:
-    Error("fail3\n");
+    for (Index = Stream->LineScanned;
+         Index != Stream->Producer;
+         Index++) {
+        UCHAR   Character;
 
-    RtlZeroMemory(&(*Stream)->Csq, sizeof (IO_CSQ));
+        Character = Stream->Buffer[Index & (Stream->BufferSize - 1)];
 
-fail2:
-    Error("fail2\n");
+        if (__StreamIsDelimiter(Stream, Character)) {
+            Stream->LineScanned = Index;
+            return Index + 1 - Stream->Consumer;
+        }
+    }
 
-    RtlZeroMemory(&(*Stream)->List, sizeof (LIST_ENTRY));
-    RtlZeroMemory(&(*Stream)->Lock, sizeof (KSPIN_LOCK));
+    Stream->LineScanned = Index;
+    return 0;
+}
 
-    RtlZeroMemory(&(*Stream)->ConsoleInterface,
-                  sizeof (XENBUS_CONSOLE_INTERFACE));
+KDEFERRED_ROUTINE   StreamReadDpc;
 
-    ASSERT(IsZeroMemory(*Stream, sizeof (XENCONS_STREAM)));
-    __StreamFree(*Stream);
+VOID
+StreamReadDpc(
+    IN  PKDPC       Dpc,
+    IN  PVOID       Context,
+    IN  PVOID       Argument1,
+    IN  PVOID       Argument2
+    )
+{
+    PXENCONS_STREAM Stream = Context;
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
 
-    return status;
+    ConsoleWake(Stream->Console);
 }
 
-VOID
-StreamDestroy(
-    IN  PXENCONS_STREAM Stream
+// Decide whether a read can complete under the handle's read timeouts,
+// or line mode, and if so copy out whatever is buffered. If it cannot
+// complete yet the read timer is set for the earliest time at which it
+// could.
+static BOOLEAN
+__StreamRead(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp,
+    IN  PCHAR           Buffer,
+    IN  ULONG           Length,
+    OUT PULONG          Read
     )
 {
-    Stream->Fdo = NULL;
+    KIRQL               Irql;
+    ULONG               Started;
+    ULONG               Now;
+    ULONG               Available;
+    ULONG               Minimum;
+    ULONG               Wait;
+    BOOLEAN             Complete;
+
+    *Read = 0;
+
+    Started = (ULONG)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[STREAM_IRP_STARTED];
+    Now = __StreamGetTime();
+    Wait = MAXULONG;
+
+    KeAcquireSpinLock(&Stream->Lock, &Irql);
+
+    Available = Stream->Producer - Stream->Consumer;
+
+    if (Stream->LineMode) {
+        ULONG   Line = __StreamGetLineLocked(Stream);
+
+        // A full buffer can never gain a delimiter, so give up on
+        // finding one and hand over what there is.
+        if (Line != 0) {
+            Length = __min(Length, Line);
+            Complete = TRUE;
+        } else {
+            Complete = (Available >= Length ||
+                        Available == Stream->BufferSize) ?
+                       TRUE :
+                       FALSE;
+        }
+    } else {
+        Minimum = __min(Length, __max(Stream->ReadTimeouts.MinimumLength, 1));
 
-    ThreadAlert(Stream->Thread);
-    ThreadJoin(Stream->Thread);
-    Stream->Thread = NULL;
+        Complete = (Available >= Minimum) ? TRUE : FALSE;
 
-    for (;;) {
-        PIRP    Irp;
+        if (!Complete &&
+            Available != 0 &&
+            Stream->ReadTimeouts.IntervalTimeout != 0) {
+            ULONG   Elapsed = Now - Stream->ReceiveTime;
 
-        Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL);
-        if (Irp == NULL)
-            break;
+            if (Elapsed >= Stream->ReadTimeouts.IntervalTimeout)
+                Complete = TRUE;
+            else
+                Wait = Stream->ReadTimeouts.IntervalTimeout - Elapsed;
+        }
+    }
 
-        StreamCsqCompleteCanceledIrp(&Stream->Csq,
-                                     Irp);
+    if (!Complete &&
+        Stream->ReadTimeouts.TotalTimeout != 0) {
+        ULONG   Elapsed = Now - Started;
+
+        if (Elapsed >= Stream->ReadTimeouts.TotalTimeout)
+            Complete = TRUE;
+        else
+            Wait = __min(Wait, Stream->ReadTimeouts.TotalTimeout - Elapsed);
     }
-    ASSERT(IsListEmpty(&Stream->List));
 
-    RtlZeroMemory(&Stream->Csq, sizeof (IO_CSQ));
+    if (Complete)
+        *Read = __StreamCopyOutLocked(Stream, Buffer, Length);
 
-    RtlZeroMemory(&Stream->List, sizeof (LIST_ENTRY));
-    RtlZeroMemory(&Stream->Lock, sizeof (KSPIN_LOCK));
+    KeReleaseSpinLock(&Stream->Lock, Irql);
 
-    RtlZeroMemory(&Stream->ConsoleInterface,
-                  sizeof (XENBUS_CONSOLE_INTERFACE));
+    if (!Complete && Wait != MAXULONG) {
+        LARGE_INTEGER   Timeout;
 
-    ASSERT(IsZeroMemory(Stream, sizeof (XENCONS_STREAM)));
-    __StreamFree(Stream);
+        Timeout.QuadPart = -10000ll * Wait;
+        (VOID) KeSetTimer(&Stream->ReadTimer, Timeout, &Stream->ReadDpc);
+    }
+
+    return Complete;
 }
 
-NTSTATUS
-StreamPutQueue(
+// Reads and writes use direct I/O so the data is copied straight
+// between the caller's pages and the console buffers. The system
+// mapping is cached in the MDL so this is cheap to repeat each time a
+// blocked IRP is retried.
+static FORCEINLINE PCHAR
+__StreamGetBuffer(
+    IN  PIRP    Irp
+    )
+{
+    if (Irp->MdlAddress == NULL)
+        return NULL;
+
+    return MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+                                        NormalPagePriority |
+                                        MdlMappingNoExecute);
+}
+
+// Buffer as much of a write as the console will take. The amount
+// already buffered is kept in the IRP so that a whole-length write can
+// resume where it left off. Returns FALSE if the write has to wait for
+// space.
+static BOOLEAN
+__StreamWrite(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp,
+    IN  PCHAR           Buffer,
+    IN  ULONG           Length,
+    IN  BOOLEAN         Whole
+    )
+{
+    ULONG               Offset;
+    ULONG               Written;
+
+    Offset = (ULONG)Irp->IoStatus.Information;
+
+    Written = (Length != Offset) ?
+              ConsoleWrite(Stream->Console,
+                           Buffer + Offset,
+                           Length - Offset,
+                           &Stream->WriteSequence) :
+              0;
+
+    if (Written == 0 && Length != Offset)
+        return FALSE;
+
+    STREAM_STATISTIC_ADD(Stream, BytesWritten, Written);
+
+    Offset += Written;
+    Irp->IoStatus.Information = Offset;
+
+    if (Whole && Offset != Length)
+        return FALSE;
+
+    STREAM_STATISTIC_ADD(Stream, WritesCompleted, 1);
+
+    return TRUE;
+}
+
+// Attempt to satisfy the IRP. Returns FALSE, leaving the IRP untouched
+// other than the progress of a whole-length write, if it would block.
+static BOOLEAN
+__StreamTransfer(
     IN  PXENCONS_STREAM Stream,
     IN  PIRP            Irp
     )
 {
-    return IoCsqInsertIrpEx(&Stream->Csq, Irp, NULL, (PVOID)FALSE);
+    PIO_STACK_LOCATION  StackLocation;
+    UCHAR               MajorFunction;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    MajorFunction = StackLocation->MajorFunction;
+
+    switch (MajorFunction) {
+    case IRP_MJ_READ: {
+        ULONG   Length;
+        PCHAR   Buffer;
+        ULONG   Read;
+
+        Length = StackLocation->Parameters.Read.Length;
+        Buffer = __StreamGetBuffer(Irp);
+
+        if (Buffer == NULL && Length != 0) {
+            Irp->IoStatus.Information = 0;
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        if (!__StreamRead(Stream, Irp, Buffer, Length, &Read))
+            return FALSE;
+
+        STREAM_STATISTIC_ADD(Stream, BytesRead, Read);
+        STREAM_STATISTIC_ADD(Stream, ReadsCompleted, 1);
+
+        Irp->IoStatus.Information = Read;
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        break;
+    }
+    case IRP_MJ_WRITE: {
+        ULONG   Length;
+        PCHAR   Buffer;
+
+        Length = StackLocation->Parameters.Write.Length;
+        Buffer = __StreamGetBuffer(Irp);
+
+        if (Buffer == NULL && Length != 0) {
+            Irp->IoStatus.Information = 0;
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        if (!__StreamWrite(Stream, Irp, Buffer, Length, Stream->WriteWhole))
+            return FALSE;
+
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        break;
+    }
+    case IRP_MJ_DEVICE_CONTROL:
+        if (StackLocation->Parameters.DeviceIoControl.IoControlCode ==
+            IOCTL_XENCONS_WRITE_PRIORITY) {
+            ULONG   Length;
+
+            Length = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+
+            if (!ConsoleWritePriority(Stream->Console,
+                                      Irp->AssociatedIrp.SystemBuffer,
+                                      Length))
+                return FALSE;
+
+            STREAM_STATISTIC_ADD(Stream, BytesWritten, Length);
+            STREAM_STATISTIC_ADD(Stream, WritesCompleted, 1);
+
+            Irp->IoStatus.Information = 0;
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            break;
+        }
+
+        if (__StreamIsWriteVector(Irp)) {
+            PSTREAM_GATHER  Gather;
+
+            Gather = *(PSTREAM_GATHER *)Irp->AssociatedIrp.SystemBuffer;
+
+            if (!__StreamWrite(Stream,
+                               Irp,
+                               Gather->Buffer,
+                               Gather->Length,
+                               TRUE))
+                return FALSE;
+
+            __StreamFreeGather(Irp);
+
+            // Nothing is copied back to the caller
+            Irp->IoStatus.Information = 0;
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            break;
+        }
+
+        // FALLTHROUGH
+
+    case IRP_MJ_FLUSH_BUFFERS:
+        // Flush requests go through the write queue, so every write
+        // ahead of them has already been buffered.
+        if (!ConsoleIsTransmitted(Stream->Console, Stream->WriteSequence))
+            return FALSE;
+
+        Irp->IoStatus.Information = 0;
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        break;
+
+    default:
+        ASSERT(FALSE);
+
+        Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
+        break;
+    }
+
+    TraceEvent(XENCONS_TRACE_COMPLETE,
+               MajorFunction,
+               Irp->IoStatus.Status,
+               (ULONG)Irp->IoStatus.Information);
+
+    return TRUE;
+}
+
+static FORCEINLINE VOID
+__StreamLatencyAdd(
+    IN  PULONG64    Histogram,
+    IN  ULONG       Microseconds
+    )
+{
+    ULONG           Bucket;
+
+    if (!_BitScanReverse(&Bucket, Microseconds))
+        Bucket = 0;
+
+    ASSERT3U(Bucket, <, XENCONS_LATENCY_BUCKETS);
+    (VOID) InterlockedIncrement64((PLONG64)&Histogram[Bucket]);
+}
+
+// Time each attempt at an IRP so that, when it completes, the time it
+// spent can be split into waiting to be looked at, waiting for the
+// console and actually moving the data.
+static BOOLEAN
+StreamTransfer(
+    IN  PXENCONS_STREAM             Stream,
+    IN  PIRP                        Irp
+    )
+{
+    PIO_STACK_LOCATION              StackLocation;
+    PXENCONS_LATENCY_HISTOGRAM      Histogram;
+    ULONG                           Arrived;
+    ULONG                           Attempt;
+    ULONG                           Start;
+    ULONG                           End;
+
+    Start = __StreamGetTimestamp();
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    // Only the IRP at the head of its queue is ever attempted, so read
+    // timeouts run from here rather than from arrival. Otherwise a read
+    // posted ahead of time could expire while waiting behind another.
+    if (Irp->Tail.Overlay.DriverContext[STREAM_IRP_ATTEMPT] == NULL) {
+        Irp->Tail.Overlay.DriverContext[STREAM_IRP_ATTEMPT] =
+            (PVOID)(ULONG_PTR)Start;
+
+        if (StackLocation->MajorFunction == IRP_MJ_READ)
+            Irp->Tail.Overlay.DriverContext[STREAM_IRP_STARTED] =
+                (PVOID)(ULONG_PTR)__StreamGetTime();
+    }
+
+    if (!__StreamTransfer(Stream, Irp))
+        return FALSE;
+
+    End = __StreamGetTimestamp();
+
+    switch (StackLocation->MajorFunction) {
+    case IRP_MJ_READ:
+        Histogram = &Stream->Latency->Read;
+        break;
+
+    case IRP_MJ_WRITE:
+        Histogram = &Stream->Latency->Write;
+        break;
+
+    default:
+        return TRUE;
+    }
+
+    Arrived = (ULONG)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[STREAM_IRP_ARRIVED];
+    Attempt = (ULONG)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[STREAM_IRP_ATTEMPT];
+
+    __StreamLatencyAdd(Histogram->Queued, Attempt - Arrived);
+    __StreamLatencyAdd(Histogram->Blocked, Start - Attempt);
+    __StreamLatencyAdd(Histogram->Copy, End - Start);
+
+    return TRUE;
+}
+
+static FORCEINLINE VOID
+__StreamQueueBlocked(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    STREAM_STATISTIC_ADD(Stream, RequestsBlocked, 1);
+    TraceEvent(XENCONS_TRACE_BLOCKED,
+               IoGetCurrentIrpStackLocation(Irp)->MajorFunction,
+               0,
+               0);
+}
+
+static FORCEINLINE VOID
+__StreamQueueComplete(
+    IN  PSTREAM_QUEUE   Queue,
+    IN  PIRP            Irp
+    )
+{
+    ASSERT(Queue->Depth != 0);
+    (VOID) InterlockedDecrement(&Queue->Depth);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+// Service IRPs from the head of the queue until either the queue is
+// empty or the queue's direction is found to be blocked. A blocked
+// queue is simply left for the next wakeup; it does not hold up the
+// queue for the other direction.
+static BOOLEAN
+StreamQueueDrain(
+    IN  PXENCONS_STREAM Stream,
+    IN  PSTREAM_QUEUE   Queue
+    )
+{
+    PIRP                Batch;
+    PIRP                Irp;
+    BOOLEAN             Completed;
+    NTSTATUS            status;
+
+    Completed = FALSE;
+
+    Batch = __StreamQueueSplice(Queue);
+
+    // Only the holder of the queue inserts into the CSQ, so if it looks
+    // empty it is. Anything parked there is older than the batch, so the
+    // batch has to go behind it.
+    if (!IsListEmpty(&Queue->List)) {
+        __StreamQueuePark(Queue, Batch);
+        Batch = NULL;
+    }
+
+    while (!IsListEmpty(&Queue->List)) {
+        Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL);
+        if (Irp == NULL)
+            break;
+
+        if (!StreamTransfer(Stream, Irp)) {
+            status = IoCsqInsertIrpEx(&Queue->Csq,
+                                      Irp,
+                                      NULL,
+                                      (PVOID)TRUE);
+            ASSERT(NT_SUCCESS(status));
+
+            __StreamQueueBlocked(Stream, Irp);
+            return Completed;
+        }
+
+        __StreamQueueComplete(Queue, Irp);
+        Completed = TRUE;
+    }
+
+    // The common case: nothing was waiting, so the batch is serviced
+    // without touching the CSQ unless it blocks.
+    while (Batch != NULL) {
+        Irp = Batch;
+        Batch = __StreamIrpGetNext(Irp);
+        __StreamIrpSetNext(Irp, NULL);
+
+        if (!StreamTransfer(Stream, Irp)) {
+            __StreamIrpSetNext(Irp, Batch);
+            __StreamQueuePark(Queue, Irp);
+
+            __StreamQueueBlocked(Stream, Irp);
+            break;
+        }
+
+        __StreamQueueComplete(Queue, Irp);
+        Completed = TRUE;
+    }
+
+    return Completed;
+}
+
+// Move buffered input into a mapped receive ring. Only the indices are
+// read back from the shared page and the caller's consumer index is not
+// trusted; if it is inconsistent nothing is copied.
+static BOOLEAN
+StreamRingReceive(
+    IN  PXENCONS_STREAM     Stream
+    )
+{
+    PXENCONS_RING_HEADER    Header = Stream->RingHeader;
+    PCHAR                   Ring;
+    ULONG                   Producer;
+    ULONG                   Consumer;
+    ULONG                   Space;
+
+    Ring = Stream->RingReceive;
+
+    Producer = Stream->RingReceiveProducer;
+    Consumer = Header->ReceiveConsumer;
+    KeMemoryBarrier();
+
+    if (Producer - Consumer > STREAM_RING_SIZE)
+        return FALSE;
+
+    Space = STREAM_RING_SIZE - (Producer - Consumer);
+
+    while (Space != 0) {
+        ULONG   Offset;
+        ULONG   Count;
+
+        Offset = Producer & (STREAM_RING_SIZE - 1);
+        Count = __min(Space, STREAM_RING_SIZE - Offset);
+
+        if (!__StreamCopyOut(Stream, &Ring[Offset], Count, &Count))
+            break;
+
+        Producer += Count;
+        Space -= Count;
+    }
+
+    if (Producer == Stream->RingReceiveProducer)
+        return FALSE;
+
+    STREAM_STATISTIC_ADD(Stream, BytesRead,
+                         Producer - Stream->RingReceiveProducer);
+
+    KeMemoryBarrier();
+    Header->ReceiveProducer = Stream->RingReceiveProducer = Producer;
+
+    KeSetEvent(Stream->RingEvent, IO_NO_INCREMENT, FALSE);
+
+    return TRUE;
+}
+
+// Move data from a mapped transmit ring into the console. The caller's
+// producer index is not trusted; if it is inconsistent nothing is
+// copied.
+static BOOLEAN
+StreamRingTransmit(
+    IN  PXENCONS_STREAM     Stream
+    )
+{
+    PXENCONS_RING_HEADER    Header = Stream->RingHeader;
+    PCHAR                   Ring;
+    ULONG                   Producer;
+    ULONG                   Consumer;
+
+    Ring = Stream->RingTransmit;
+
+    Producer = Header->TransmitProducer;
+    Consumer = Stream->RingTransmitConsumer;
+    KeMemoryBarrier();
+
+    if (Producer - Consumer > STREAM_RING_SIZE)
+        return FALSE;
+
+    while (Consumer != Producer) {
+        ULONG   Offset;
+        ULONG   Count;
+
+        Offset = Consumer & (STREAM_RING_SIZE - 1);
+        Count = __min(Producer - Consumer, STREAM_RING_SIZE - Offset);
+
+        Count = ConsoleWrite(Stream->Console,
+                             &Ring[Offset],
+                             Count,
+                             &Stream->WriteSequence);
+        if (Count == 0)
+            break;
+
+        Consumer += Count;
+    }
+
+    if (Consumer == Stream->RingTransmitConsumer)
+        return FALSE;
+
+    STREAM_STATISTIC_ADD(Stream, BytesWritten,
+                         Consumer - Stream->RingTransmitConsumer);
+
+    KeMemoryBarrier();
+    Header->TransmitConsumer = Stream->RingTransmitConsumer = Consumer;
+
+    KeSetEvent(Stream->RingEvent, IO_NO_INCREMENT, FALSE);
+
+    return TRUE;
+}
+
+// Called by the console worker thread whenever there may be progress to
+// be made on the stream. Returns TRUE if any was made.
+BOOLEAN
+StreamPoll(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    ULONG               Index;
+    BOOLEAN             Progress;
+
+    Progress = FALSE;
+
+    for (Index = 0; Index < STREAM_QUEUE_COUNT; Index++) {
+        PSTREAM_QUEUE   Queue = &Stream->Queue[Index];
+
+        if (!__StreamQueueClaim(Queue, FALSE))
+            continue;
+
+        if (StreamQueueDrain(Stream, Queue))
+            Progress = TRUE;
+
+        if (Stream->RingHeader != NULL) {
+            if (Index == STREAM_QUEUE_READ) {
+                if (StreamRingReceive(Stream))
+                    Progress = TRUE;
+            } else if (Index == STREAM_QUEUE_WRITE && Stream->Writable) {
+                if (StreamRingTransmit(Stream))
+                    Progress = TRUE;
+            }
+        }
+
+        __StreamQueueRelease(Queue, FALSE);
+    }
+
+    return Progress;
+}
+
+static NTSTATUS
+StreamMapRings(
+    IN  PXENCONS_STREAM     Stream,
+    IN  PIRP                Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    PXENCONS_MAP_RINGS_IN   In;
+    PXENCONS_MAP_RINGS_OUT  Out;
+    PKEVENT                 Event;
+    PMDL                    Mdl;
+    PXENCONS_RING_HEADER    Header;
+    PVOID                   Address;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (StackLocation->Parameters.DeviceIoControl.InputBufferLength !=
+        sizeof (XENCONS_MAP_RINGS_IN) ||
+        StackLocation->Parameters.DeviceIoControl.OutputBufferLength <
+        sizeof (XENCONS_MAP_RINGS_OUT))
+        goto fail1;
+
+    In = Irp->AssociatedIrp.SystemBuffer;
+
+    status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)In->Event,
+                                       EVENT_MODIFY_STATE,
+                                       *ExEventObjectType,
+                                       Irp->RequestorMode,
+                                       &Event,
+                                       NULL);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    Mdl = __AllocatePages(STREAM_RING_PAGES);
+
+    status = STATUS_NO_MEMORY;
+    if (Mdl == NULL)
+        goto fail3;
+
+    Header = Mdl->MappedSystemVa;
+
+    Header->ReceiveOffset = STREAM_RING_RECEIVE_OFFSET;
+    Header->ReceiveSize = STREAM_RING_SIZE;
+    Header->TransmitOffset = STREAM_RING_TRANSMIT_OFFSET;
+    Header->TransmitSize = STREAM_RING_SIZE;
+
+    __try {
+        Address = MmMapLockedPagesSpecifyCache(Mdl,
+                                               UserMode,
+                                               MmCached,
+                                               NULL,
+                                               FALSE,
+                                               NormalPagePriority);
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        Address = NULL;
+    }
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (Address == NULL)
+        goto fail4;
+
+    ExAcquireFastMutex(&StreamMappings.Mutex);
+    ConsoleAcquireLock(Stream->Console);
+
+    status = STATUS_INVALID_DEVICE_STATE;
+    if (Stream->RingHeader != NULL)
+        goto fail5;
+
+    // The ring addresses come from the kernel's view of the pages and
+    // are never read back from the header, which the caller can write
+    Stream->RingMdl = Mdl;
+    Stream->RingAddress = Address;
+    Stream->RingProcess = PsGetCurrentProcess();
+    ObReferenceObject(Stream->RingProcess);
+    Stream->RingEvent = Event;
+    Stream->RingReceive = (PCHAR)Header + STREAM_RING_RECEIVE_OFFSET;
+    Stream->RingTransmit = (PCHAR)Header + STREAM_RING_TRANSMIT_OFFSET;
+    Stream->RingHeader = Header;
+
+    ConsoleReleaseLock(Stream->Console);
+
+    InsertTailList(&StreamMappings.List, &Stream->RingListEntry);
+    ExReleaseFastMutex(&StreamMappings.Mutex);
+
+    ConsoleWake(Stream->Console);
+
+    Out = Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(Out, sizeof (XENCONS_MAP_RINGS_OUT));
+
+    Out->Address = (ULONG64)(ULONG_PTR)Address;
+    Out->Length = STREAM_RING_PAGES * PAGE_SIZE;
+
+    Irp->IoStatus.Information = sizeof (XENCONS_MAP_RINGS_OUT);
+
+    return STATUS_SUCCESS;
+
+fail5:
+    Error("fail5\n");
+
+    ConsoleReleaseLock(Stream->Console);
+    ExReleaseFastMutex(&StreamMappings.Mutex);
+
+    MmUnmapLockedPages(Address, Mdl);
+
+fail4:
+    Error("fail4\n");
+
+    __FreePages(Mdl);
+
+fail3:
+    Error("fail3\n");
+
+    ObDereferenceObject(Event);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// The user mapping has to be removed in the context of the process
+// that made it, which is not the case if the handle has been duplicated
+// into another process or the device is being removed. Only the user
+// view goes; the worker carries on using the kernel's view of the pages.
+// Called with the mappings mutex held.
+static VOID
+__StreamUnmapUserRings(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    KAPC_STATE          ApcState;
+    BOOLEAN             Attached;
+
+    Attached = (PsGetCurrentProcess() != Stream->RingProcess) ?
+               TRUE :
+               FALSE;
+
+    if (Attached)
+        KeStackAttachProcess(Stream->RingProcess, &ApcState);
+
+    MmUnmapLockedPages(Stream->RingAddress, Stream->RingMdl);
+
+    if (Attached)
+        KeUnstackDetachProcess(&ApcState);
+
+    Stream->RingAddress = NULL;
+
+    RemoveEntryList(&Stream->RingListEntry);
+    RtlZeroMemory(&Stream->RingListEntry, sizeof (LIST_ENTRY));
+}
+
+static VOID
+StreamUnmapRings(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    if (Stream->RingHeader == NULL)
+        return;
+
+    // The user view may already have gone with the mapping process
+    ExAcquireFastMutex(&StreamMappings.Mutex);
+
+    if (Stream->RingAddress != NULL)
+        __StreamUnmapUserRings(Stream);
+
+    ExReleaseFastMutex(&StreamMappings.Mutex);
+
+    Stream->RingHeader = NULL;
+    Stream->RingReceive = NULL;
+    Stream->RingTransmit = NULL;
+    Stream->RingReceiveProducer = 0;
+    Stream->RingTransmitConsumer = 0;
+
+    ObDereferenceObject(Stream->RingEvent);
+    Stream->RingEvent = NULL;
+
+    ObDereferenceObject(Stream->RingProcess);
+    Stream->RingProcess = NULL;
+
+    __FreePages(Stream->RingMdl);
+    Stream->RingMdl = NULL;
+}
+
+// A handle can be duplicated into, or inherited by, another process and
+// so outlive the process that mapped its rings. The user view has to be
+// removed before that process's address space is torn down.
+static VOID
+StreamProcessNotify(
+    IN  HANDLE          ParentId,
+    IN  HANDLE          ProcessId,
+    IN  BOOLEAN         Create
+    )
+{
+    PLIST_ENTRY         ListEntry;
+    PLIST_ENTRY         Next;
+
+    UNREFERENCED_PARAMETER(ParentId);
+
+    if (Create)
+        return;
+
+    ExAcquireFastMutex(&StreamMappings.Mutex);
+
+    for (ListEntry = StreamMappings.List.Flink;
+         ListEntry != &StreamMappings.List;
+         ListEntry = Next) {
+        PXENCONS_STREAM Stream;
+
+        Next = ListEntry->Flink;
+
+        Stream = CONTAINING_RECORD(ListEntry, XENCONS_STREAM, RingListEntry);
+
+        if (PsGetProcessId(Stream->RingProcess) == ProcessId)
+            __StreamUnmapUserRings(Stream);
+    }
+
+    ExReleaseFastMutex(&StreamMappings.Mutex);
+}
+
+NTSTATUS
+StreamInitialize(
+    VOID
+    )
+{
+    NTSTATUS    status;
+
+    ExInitializeFastMutex(&StreamMappings.Mutex);
+    InitializeListHead(&StreamMappings.List);
+
+    status = PsSetCreateProcessNotifyRoutine(StreamProcessNotify, FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    RtlZeroMemory(&StreamMappings, sizeof (XENCONS_STREAM_MAPPINGS));
+
+    return status;
+}
+
+VOID
+StreamTeardown(
+    VOID
+    )
+{
+    (VOID) PsSetCreateProcessNotifyRoutine(StreamProcessNotify, TRUE);
+
+    ASSERT(IsListEmpty(&StreamMappings.List));
+    RtlZeroMemory(&StreamMappings, sizeof (XENCONS_STREAM_MAPPINGS));
+}
+
+NTSTATUS
+StreamCreate(
+    IN  PXENCONS_FDO        Fdo,
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PFILE_OBJECT        FileObject,
+    OUT PXENCONS_STREAM     *Stream
+    )
+{
+    LONG                    Index;
+    NTSTATUS                status;
+
+    *Stream = __StreamAllocate(sizeof (XENCONS_STREAM));
+
+    status = STATUS_NO_MEMORY;
+    if (*Stream == NULL)
+        goto fail1;
+
+    (*Stream)->Console = Console;
+    (*Stream)->DeviceStatistics = ConsoleGetStatistics((*Stream)->Console);
+    (*Stream)->Latency = ConsoleGetLatency((*Stream)->Console);
+    (*Stream)->Readable = FileObject->ReadAccess;
+    (*Stream)->Writable = FileObject->WriteAccess;
+    (*Stream)->WriteWhole = (FileObject->Flags & FO_WRITE_THROUGH) ?
+                            TRUE :
+                            FALSE;
+
+    (*Stream)->BufferSize = ConsoleGetReadAheadSize((*Stream)->Console);
+    (*Stream)->Buffer = __StreamAllocate((*Stream)->BufferSize);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Stream)->Buffer == NULL)
+        goto fail2;
+
+    KeInitializeSpinLock(&(*Stream)->Lock);
+
+    KeInitializeTimer(&(*Stream)->ReadTimer);
+    KeInitializeDpc(&(*Stream)->ReadDpc, StreamReadDpc, *Stream);
+
+    for (Index = 0; Index < STREAM_QUEUE_COUNT; Index++) {
+        status = StreamQueueInitialize(*Stream,
+                                       &(*Stream)->Queue[Index]);
+        if (!NT_SUCCESS(status))
+            goto fail3;
+    }
+
+    status = ConsoleAddStream((*Stream)->Console, *Stream);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    (*Stream)->Fdo = Fdo;
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+    while (--Index >= 0)
+        StreamQueueTeardown(&(*Stream)->Queue[Index]);
+
+    RtlZeroMemory(&(*Stream)->ReadDpc, sizeof (KDPC));
+    RtlZeroMemory(&(*Stream)->ReadTimer, sizeof (KTIMER));
+
+    RtlZeroMemory(&(*Stream)->Lock, sizeof (KSPIN_LOCK));
+
+    __StreamFree((*Stream)->Buffer);
+    (*Stream)->Buffer = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    (*Stream)->BufferSize = 0;
+    (*Stream)->WriteWhole = FALSE;
+    (*Stream)->Writable = FALSE;
+    (*Stream)->Readable = FALSE;
+    (*Stream)->Latency = NULL;
+    (*Stream)->DeviceStatistics = NULL;
+    (*Stream)->Console = NULL;
+
+    ASSERT(IsZeroMemory(*Stream, sizeof (XENCONS_STREAM)));
+    __StreamFree(*Stream);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+StreamDestroy(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    ULONG               Index;
+
+    Stream->Fdo = NULL;
+
+    ConsoleRemoveStream(Stream->Console, Stream);
+
+    StreamUnmapRings(Stream);
+
+    for (Index = 0; Index < STREAM_QUEUE_COUNT; Index++)
+        StreamQueueTeardown(&Stream->Queue[Index]);
+
+    (VOID) KeCancelTimer(&Stream->ReadTimer);
+    KeFlushQueuedDpcs();
+
+    RtlZeroMemory(&Stream->ReadDpc, sizeof (KDPC));
+    RtlZeroMemory(&Stream->ReadTimer, sizeof (KTIMER));
+
+    Stream->LineScanned = 0;
+    RtlZeroMemory(Stream->LineDelimiters, sizeof (Stream->LineDelimiters));
+    Stream->LineMode = FALSE;
+
+    RtlZeroMemory(&Stream->ReadTimeouts, sizeof (XENCONS_READ_TIMEOUTS));
+
+    __StreamFree(Stream->Buffer);
+    Stream->Buffer = NULL;
+    Stream->BufferSize = 0;
+    Stream->ReceiveTime = 0;
+    Stream->ReceiveOverflow = FALSE;
+    Stream->Producer = 0;
+    Stream->Consumer = 0;
+
+    RtlZeroMemory(&Stream->Lock, sizeof (KSPIN_LOCK));
+
+    RtlZeroMemory(&Stream->Statistics, sizeof (XENCONS_STATISTICS));
+
+    Stream->WriteSequence = 0;
+    Stream->WriteWhole = FALSE;
+    Stream->Writable = FALSE;
+    Stream->Readable = FALSE;
+    Stream->Latency = NULL;
+    Stream->DeviceStatistics = NULL;
+    Stream->Console = NULL;
+
+    ASSERT(IsZeroMemory(Stream, sizeof (XENCONS_STREAM)));
+    __StreamFree(Stream);
+}
+
+static NTSTATUS
+StreamPutQueue(
+    IN  PSTREAM_QUEUE   Queue,
+    IN  PIRP            Irp
+    )
+{
+    PXENCONS_STREAM     Stream = Queue->Stream;
+    ULONG               Depth;
+
+    IoMarkIrpPending(Irp);
+
+    Depth = (ULONG)InterlockedIncrement(&Queue->Depth);
+
+    // Priority writes jump the write queue rather than joining it, so
+    // they do not count towards its depth.
+    if (Queue == &Stream->Queue[STREAM_QUEUE_READ]) {
+        __StreamHighWater(&Stream->Statistics.ReadQueueHighWater, Depth);
+        __StreamHighWater(&Stream->DeviceStatistics->ReadQueueHighWater,
+                          Depth);
+    } else if (Queue == &Stream->Queue[STREAM_QUEUE_WRITE]) {
+        __StreamHighWater(&Stream->Statistics.WriteQueueHighWater, Depth);
+        __StreamHighWater(&Stream->DeviceStatistics->WriteQueueHighWater,
+                          Depth);
+    }
+
+    // The IRP cannot be cancelled until the worker thread has parked it
+    // on the CSQ, which it does on its next pass.
+    __StreamQueuePush(Queue, Irp);
+    ConsoleWake(Stream->Console);
+
+    return STATUS_PENDING;
+}
+
+static NTSTATUS
+StreamSubmit(
+    IN  PXENCONS_STREAM Stream,
+    IN  PSTREAM_QUEUE   Queue,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    UCHAR               MajorFunction;
+    ULONG               Length;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    MajorFunction = StackLocation->MajorFunction;
+
+    switch (MajorFunction) {
+    case IRP_MJ_READ:
+        Length = StackLocation->Parameters.Read.Length;
+        break;
+
+    case IRP_MJ_WRITE:
+        Length = StackLocation->Parameters.Write.Length;
+        break;
+
+    default:
+        Length = 0;
+        break;
+    }
+
+    TraceEvent(XENCONS_TRACE_SUBMIT, MajorFunction, Length, 0);
+
+    Irp->IoStatus.Information = 0;
+
+    Irp->Tail.Overlay.DriverContext[STREAM_IRP_ARRIVED] =
+        (PVOID)(ULONG_PTR)__StreamGetTimestamp();
+    Irp->Tail.Overlay.DriverContext[STREAM_IRP_ATTEMPT] = NULL;
+
+    // If nothing is queued ahead of this IRP and it can be satisfied
+    // straight away then complete it here rather than waking the
+    // console worker thread.
+    if (!__StreamQueueClaim(Queue, TRUE))
+        return StreamPutQueue(Queue, Irp);
+
+    if (!StreamTransfer(Stream, Irp)) {
+        STREAM_STATISTIC_ADD(Stream, RequestsBlocked, 1);
+        TraceEvent(XENCONS_TRACE_BLOCKED, MajorFunction, 0, 0);
+
+        status = StreamPutQueue(Queue, Irp);
+
+        __StreamQueueRelease(Queue, TRUE);
+        return status;
+    }
+
+    __StreamQueueRelease(Queue, TRUE);
+
+    status = Irp->IoStatus.Status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+static NTSTATUS
+StreamSetWriteWhole(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Length;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Length != sizeof (ULONG))
+        goto fail1;
+
+    Stream->WriteWhole = (*(PULONG)Irp->AssociatedIrp.SystemBuffer != 0) ?
+                         TRUE :
+                         FALSE;
+
+    Info("%s\n", (Stream->WriteWhole) ? "ON" : "OFF");
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StreamSetReadTimeouts(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Length;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Length != sizeof (XENCONS_READ_TIMEOUTS))
+        goto fail1;
+
+    KeAcquireSpinLock(&Stream->Lock, &Irql);
+
+    Stream->ReadTimeouts = *(PXENCONS_READ_TIMEOUTS)Irp->AssociatedIrp.SystemBuffer;
+
+    // The minimum can never be more than the buffer can hold
+    Stream->ReadTimeouts.MinimumLength =
+        __min(Stream->ReadTimeouts.MinimumLength, Stream->BufferSize);
+
+    KeReleaseSpinLock(&Stream->Lock, Irql);
+
+    // Re-evaluate any pending read against the new values
+    ConsoleWake(Stream->Console);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StreamSetLineMode(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    static const UCHAR  Default[] = { '\r', '\n', 0x03 };
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Length;
+    PXENCONS_LINE_MODE  LineMode;
+    const UCHAR         *Delimiter;
+    ULONG               Count;
+    ULONG               Index;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Length != sizeof (XENCONS_LINE_MODE))
+        goto fail1;
+
+    LineMode = Irp->AssociatedIrp.SystemBuffer;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (LineMode->Count > XENCONS_LINE_DELIMITERS)
+        goto fail2;
+
+    if (LineMode->Count != 0) {
+        Delimiter = LineMode->Delimiter;
+        Count = LineMode->Count;
+    } else {
+        Delimiter = Default;
+        Count = ARRAYSIZE(Default);
+    }
+
+    KeAcquireSpinLock(&Stream->Lock, &Irql);
+
+    RtlZeroMemory(Stream->LineDelimiters, sizeof (Stream->LineDelimiters));
+
+    for (Index = 0; Index < Count; Index++)
+        Stream->LineDelimiters[Delimiter[Index] >> 5] |=
+            1ul << (Delimiter[Index] & 31);
+
+    Stream->LineScanned = Stream->Consumer;
+    Stream->LineMode = (LineMode->Enabled != 0) ? TRUE : FALSE;
+
+    KeReleaseSpinLock(&Stream->Lock, Irql);
+
+    Info("%s\n", (Stream->LineMode) ? "ON" : "OFF");
+
+    // Re-evaluate any pending read against the new mode
+    ConsoleWake(Stream->Console);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Gather the caller's buffers into one so that they can be written as a
+// single whole-length write.
+static NTSTATUS
+StreamWriteVector(
+    IN  PXENCONS_STREAM     Stream,
+    IN  PIRP                Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   Length;
+    PXENCONS_WRITE_SEGMENT  Segment;
+    ULONG                   Count;
+    ULONG                   Total;
+    ULONG                   Index;
+    PSTREAM_GATHER          Gather;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+
+    Count = Length / sizeof (XENCONS_WRITE_SEGMENT);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Count == 0 ||
+        Count > XENCONS_WRITE_SEGMENTS_MAXIMUM ||
+        Length != Count * sizeof (XENCONS_WRITE_SEGMENT))
+        goto fail1;
+
+    Segment = Irp->AssociatedIrp.SystemBuffer;
+
+    Total = 0;
+    for (Index = 0; Index < Count; Index++) {
+        status = STATUS_INVALID_PARAMETER;
+        if (Segment[Index].Length > XENCONS_WRITE_VECTOR_MAXIMUM - Total)
+            goto fail2;
+
+        Total += Segment[Index].Length;
+    }
+
+    Gather = __StreamAllocate(FIELD_OFFSET(STREAM_GATHER, Buffer) + Total);
+
+    status = STATUS_NO_MEMORY;
+    if (Gather == NULL)
+        goto fail3;
+
+    // The dispatch routine runs in the context of the caller so its
+    // buffers can be read directly.
+    __try {
+        for (Index = 0; Index < Count; Index++) {
+            PVOID   Buffer = (PVOID)(ULONG_PTR)Segment[Index].Buffer;
+
+            if (Irp->RequestorMode != KernelMode)
+                ProbeForRead(Buffer, Segment[Index].Length, sizeof (UCHAR));
+
+            RtlCopyMemory(&Gather->Buffer[Gather->Length],
+                          Buffer,
+                          Segment[Index].Length);
+            Gather->Length += Segment[Index].Length;
+        }
+
+        status = STATUS_SUCCESS;
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    ASSERT3U(Gather->Length, ==, Total);
+
+    *(PSTREAM_GATHER *)Irp->AssociatedIrp.SystemBuffer = Gather;
+
+    return StreamSubmit(Stream, &Stream->Queue[STREAM_QUEUE_WRITE], Irp);
+
+fail4:
+    Error("fail4\n");
+
+    __StreamFree(Gather);
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+static NTSTATUS
+StreamWritePriority(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Length;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Length == 0 || Length > XENCONS_WRITE_PRIORITY_MAXIMUM)
+        goto fail1;
+
+    return StreamSubmit(Stream, &Stream->Queue[STREAM_QUEUE_PRIORITY], Irp);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+static NTSTATUS
+StreamQueryStatistics(
+    IN  PXENCONS_STREAM             Stream,
+    IN  PIRP                        Irp
+    )
+{
+    PIO_STACK_LOCATION              StackLocation;
+    ULONG                           Length;
+    PXENCONS_QUERY_STATISTICS_OUT   Out;
+    NTSTATUS                        status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (Length < sizeof (XENCONS_QUERY_STATISTICS_OUT))
+        goto fail1;
+
+    Out = Irp->AssociatedIrp.SystemBuffer;
+
+    // Individual counters are updated atomically but the set as a whole
+    // is not a consistent snapshot.
+    Out->Handle = Stream->Statistics;
+    Out->Device = *Stream->DeviceStatistics;
+
+    Irp->IoStatus.Information = sizeof (XENCONS_QUERY_STATISTICS_OUT);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StreamQueryLatency(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Length;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (Length < sizeof (XENCONS_LATENCY))
+        goto fail1;
+
+    RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer,
+                  Stream->Latency,
+                  sizeof (XENCONS_LATENCY));
+
+    Irp->IoStatus.Information = sizeof (XENCONS_LATENCY);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StreamResetLatency(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    PLONG64             Bucket;
+    ULONG               Index;
+
+    Bucket = (PLONG64)Stream->Latency;
+
+    for (Index = 0; Index < sizeof (XENCONS_LATENCY) / sizeof (LONG64); Index++)
+        (VOID) InterlockedExchange64(&Bucket[Index], 0);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+StreamQueryOccupancy(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Length;
+    PXENCONS_OCCUPANCY  Occupancy;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (Length < sizeof (XENCONS_OCCUPANCY))
+        goto fail1;
+
+    Occupancy = Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(Occupancy, sizeof (XENCONS_OCCUPANCY));
+
+    KeAcquireSpinLock(&Stream->Lock, &Irql);
+    Occupancy->ReadAvailable = Stream->Producer - Stream->Consumer;
+    KeReleaseSpinLock(&Stream->Lock, Irql);
+
+    Occupancy->ReadSize = Stream->BufferSize;
+
+    ConsoleQueryOccupancy(Stream->Console, Occupancy);
+
+    Irp->IoStatus.Information = sizeof (XENCONS_OCCUPANCY);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StreamDeviceControl(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               IoControlCode;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    IoControlCode = StackLocation->Parameters.DeviceIoControl.IoControlCode;
+
+    Irp->IoStatus.Information = 0;
+
+    switch (IoControlCode) {
+    case IOCTL_XENCONS_FLUSH:
+        return StreamSubmit(Stream, &Stream->Queue[STREAM_QUEUE_WRITE], Irp);
+
+    case IOCTL_XENCONS_WRITE_VECTOR:
+        if (Stream->RingHeader != NULL) {
+            status = STATUS_INVALID_DEVICE_STATE;
+            break;
+        }
+
+        return StreamWriteVector(Stream, Irp);
+
+    case IOCTL_XENCONS_WRITE_PRIORITY:
+        return StreamWritePriority(Stream, Irp);
+
+    case IOCTL_XENCONS_SET_WRITE_WHOLE:
+        status = StreamSetWriteWhole(Stream, Irp);
+        break;
+
+    case IOCTL_XENCONS_MAP_RINGS:
+        status = StreamMapRings(Stream, Irp);
+        break;
+
+    case IOCTL_XENCONS_SET_READ_TIMEOUTS:
+        status = StreamSetReadTimeouts(Stream, Irp);
+        break;
+
+    case IOCTL_XENCONS_SET_LINE_MODE:
+        status = StreamSetLineMode(Stream, Irp);
+        break;
+
+    case IOCTL_XENCONS_QUERY_STATISTICS:
+        status = StreamQueryStatistics(Stream, Irp);
+        break;
+
+    case IOCTL_XENCONS_QUERY_LATENCY:
+        status = StreamQueryLatency(Stream, Irp);
+        break;
+
+    case IOCTL_XENCONS_QUERY_OCCUPANCY:
+        status = StreamQueryOccupancy(Stream, Irp);
+        break;
+
+    case IOCTL_XENCONS_QUERY_RESUME_TIMING:
+        status = FdoQueryResumeTiming(Stream->Fdo, Irp);
+        break;
+
+    case IOCTL_XENCONS_RESET_LATENCY:
+        status = StreamResetLatency(Stream);
+        break;
+
+    case IOCTL_XENCONS_READ_TRACE:
+        status = TraceRead(Irp);
+        break;
+
+    case IOCTL_XENCONS_KICK:
+        ConsoleWake(Stream->Console);
+        status = STATUS_SUCCESS;
+        break;
+
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+NTSTATUS
+StreamDispatch(
+    IN  PXENCONS_STREAM Stream,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    switch (StackLocation->MajorFunction) {
+    case IRP_MJ_READ:
+        // Once the rings are mapped, input is only delivered through them
+        if (Stream->RingHeader != NULL) {
+            status = STATUS_INVALID_DEVICE_STATE;
+            break;
+        }
+
+        return StreamSubmit(Stream, &Stream->Queue[STREAM_QUEUE_READ], Irp);
+
+    case IRP_MJ_WRITE:
+        if (Stream->RingHeader != NULL) {
+            status = STATUS_INVALID_DEVICE_STATE;
+            break;
+        }
+
+        return StreamSubmit(Stream, &Stream->Queue[STREAM_QUEUE_WRITE], Irp);
+
+    case IRP_MJ_FLUSH_BUFFERS:
+        return StreamSubmit(Stream, &Stream->Queue[STREAM_QUEUE_WRITE], Irp);
+
+    case IRP_MJ_DEVICE_CONTROL:
+        return StreamDeviceControl(Stream, Irp);
+
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+
+    Irp->IoStatus.Information = 0;
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
 }
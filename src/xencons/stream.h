@@ -34,14 +34,26 @@
 
 #include <ntddk.h>
 
+typedef struct _XENCONS_STREAM XENCONS_STREAM, *PXENCONS_STREAM;
+
 #include "fdo.h"
 
-typedef struct _XENCONS_STREAM XENCONS_STREAM, *PXENCONS_STREAM;
+extern NTSTATUS
+StreamInitialize(
+    VOID
+    );
+
+extern VOID
+StreamTeardown(
+    VOID
+    );
 
 extern NTSTATUS
 StreamCreate(
-    IN  PXENCONS_FDO    Fdo,
-    OUT PXENCONS_STREAM *Stream
+    IN  PXENCONS_FDO        Fdo,
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PFILE_OBJECT        FileObject,
+    OUT PXENCONS_STREAM     *Stream
     );
 
 extern VOID
@@ -50,9 +62,26 @@ StreamDestroy(
     );
 
 extern NTSTATUS
-StreamPutQueue(
+StreamDispatch(
     IN  PXENCONS_STREAM Stream,
     IN  PIRP            Irp
     );
 
+extern BOOLEAN
+StreamIsReadable(
+    IN  PXENCONS_STREAM Stream
+    );
+
+extern VOID
+StreamReceive(
+    IN  PXENCONS_STREAM Stream,
+    IN  PCHAR           Buffer,
+    IN  ULONG           Length
+    );
+
+extern BOOLEAN
+StreamPoll(
+    IN  PXENCONS_STREAM Stream
+    );
+
 #endif  // _XENCONS_STREAM_H
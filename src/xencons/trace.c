@@ -0,0 +1,285 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <procgrp.h>
+#include <xencons_device.h>
+
+#include "trace.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+#define TRACE_TAG 'CRTX'
+
+// Must be a power of two
+#define TRACE_RING_SIZE 256
+
+typedef struct _TRACE_RING {
+    LONG                    Producer;
+    ULONG                   Consumer;
+    ULONG                   Lost;
+    XENCONS_TRACE_RECORD    Record[TRACE_RING_SIZE];
+} TRACE_RING, *PTRACE_RING;
+
+typedef struct _XENCONS_TRACE {
+    PTRACE_RING Ring;
+    ULONG       Count;
+    LONG64      Frequency;
+    FAST_MUTEX  Mutex;
+} XENCONS_TRACE, *PXENCONS_TRACE;
+
+static XENCONS_TRACE    TraceContext;
+
+static FORCEINLINE PVOID
+__TraceAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocatePoolWithTag(NonPagedPool, Length, TRACE_TAG);
+}
+
+static FORCEINLINE VOID
+__TraceFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, TRACE_TAG);
+}
+
+NTSTATUS
+TraceInitialize(
+    VOID
+    )
+{
+    LARGE_INTEGER   Frequency;
+    ULONG           Count;
+    NTSTATUS        status;
+
+    ASSERT3P(TraceContext.Ring, ==, NULL);
+
+    Count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    TraceContext.Ring = __TraceAllocate(sizeof (TRACE_RING) * Count);
+
+    status = STATUS_NO_MEMORY;
+    if (TraceContext.Ring == NULL)
+        goto fail1;
+
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+
+    TraceContext.Count = Count;
+    TraceContext.Frequency = Frequency.QuadPart;
+    ExInitializeFastMutex(&TraceContext.Mutex);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+TraceTeardown(
+    VOID
+    )
+{
+    __TraceFree(TraceContext.Ring);
+
+    RtlZeroMemory(&TraceContext, sizeof (XENCONS_TRACE));
+}
+
+// Callable at any IRQL. A record is claimed by bumping the producer of
+// the current processor's ring and published by writing its sequence
+// number last, so the reader can tell a complete record from one that
+// is still being written or has been overwritten since.
+VOID
+TraceEvent(
+    IN  USHORT              Event,
+    IN  ULONG               Argument0,
+    IN  ULONG               Argument1,
+    IN  ULONG               Argument2
+    )
+{
+    ULONG                   Cpu;
+    PTRACE_RING             Ring;
+    ULONG                   Slot;
+    PXENCONS_TRACE_RECORD   Record;
+
+    if (TraceContext.Ring == NULL)
+        return;
+
+    Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    if (Cpu >= TraceContext.Count)
+        return;
+
+    Ring = &TraceContext.Ring[Cpu];
+
+    // The thread may migrate after reading the processor number; the
+    // interlocked claim keeps the ring consistent regardless.
+    Slot = (ULONG)InterlockedIncrement(&Ring->Producer) - 1;
+    Record = &Ring->Record[Slot & (TRACE_RING_SIZE - 1)];
+
+    Record->Sequence = 0;
+    KeMemoryBarrier();
+
+    Record->Event = Event;
+    Record->Cpu = (USHORT)Cpu;
+    Record->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    Record->Argument[0] = Argument0;
+    Record->Argument[1] = Argument1;
+    Record->Argument[2] = Argument2;
+    Record->Argument[3] = 0;
+
+    KeMemoryBarrier();
+    Record->Sequence = Slot + 1;
+}
+
+static ULONG
+TraceDrainRing(
+    IN  PTRACE_RING             Ring,
+    IN  PXENCONS_TRACE_RECORD   Buffer,
+    IN  ULONG                   Count
+    )
+{
+    ULONG                       Producer;
+    ULONG                       Consumer;
+    ULONG                       Copied;
+
+    Producer = (ULONG)*(volatile LONG *)&Ring->Producer;
+    KeMemoryBarrier();
+
+    Consumer = Ring->Consumer;
+
+    if (Producer - Consumer > TRACE_RING_SIZE) {
+        Ring->Lost += Producer - Consumer - TRACE_RING_SIZE;
+        Consumer = Producer - TRACE_RING_SIZE;
+    }
+
+    Copied = 0;
+    while (Consumer != Producer && Copied < Count) {
+        PXENCONS_TRACE_RECORD   Record;
+        ULONG                   Sequence;
+
+        Record = &Ring->Record[Consumer & (TRACE_RING_SIZE - 1)];
+
+        Sequence = *(volatile ULONG *)&Record->Sequence;
+        KeMemoryBarrier();
+
+        // Still being written: stop here and pick it up next time.
+        if (Sequence == 0 || (LONG)(Sequence - (Consumer + 1)) < 0)
+            break;
+
+        Buffer[Copied] = *Record;
+        KeMemoryBarrier();
+
+        // Overwritten, either before or while it was being copied.
+        if (Sequence != Consumer + 1 ||
+            *(volatile ULONG *)&Record->Sequence != Sequence) {
+            Ring->Lost++;
+            Consumer++;
+            continue;
+        }
+
+        Copied++;
+        Consumer++;
+    }
+
+    Ring->Consumer = Consumer;
+
+    return Copied;
+}
+
+// Drain as many records as fit in the output buffer, and reset the
+// count of lost records.
+NTSTATUS
+TraceRead(
+    IN  PIRP                Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   Length;
+    PXENCONS_TRACE_HEADER   Header;
+    PXENCONS_TRACE_RECORD   Record;
+    ULONG                   Count;
+    ULONG                   Index;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Length = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (Length < sizeof (XENCONS_TRACE_HEADER))
+        goto fail1;
+
+    status = STATUS_NOT_SUPPORTED;
+    if (TraceContext.Ring == NULL)
+        goto fail2;
+
+    Header = Irp->AssociatedIrp.SystemBuffer;
+    Record = (PXENCONS_TRACE_RECORD)(Header + 1);
+    Count = (Length - sizeof (XENCONS_TRACE_HEADER)) /
+            sizeof (XENCONS_TRACE_RECORD);
+
+    RtlZeroMemory(Header, sizeof (XENCONS_TRACE_HEADER));
+    Header->Frequency = TraceContext.Frequency;
+
+    ExAcquireFastMutex(&TraceContext.Mutex);
+
+    for (Index = 0; Index < TraceContext.Count; Index++) {
+        PTRACE_RING Ring = &TraceContext.Ring[Index];
+        ULONG       Copied;
+
+        Copied = TraceDrainRing(Ring,
+                                &Record[Header->Count],
+                                Count - Header->Count);
+        Header->Count += Copied;
+
+        Header->Lost += Ring->Lost;
+        Ring->Lost = 0;
+    }
+
+    ExReleaseFastMutex(&TraceContext.Mutex);
+
+    Irp->IoStatus.Information = sizeof (XENCONS_TRACE_HEADER) +
+                                Header->Count * sizeof (XENCONS_TRACE_RECORD);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}